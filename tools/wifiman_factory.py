@@ -0,0 +1,123 @@
+#!/usr/bin/env python3
+# Generates a factory network table for wifiman_loadFactoryNetworks from a
+# CSV file (ssid,password per line, empty password for open networks):
+#
+#   python3 tools/wifiman_factory.py networks.csv > wifi_factory_networks.h
+#
+#   #include "wifi_factory_networks.h"
+#   wifiman_loadFactoryNetworks(data, WM_FACTORY_NETWORKS, WM_FACTORY_NETWORK_COUNT,
+#                               WM_FACTORY_NETWORK_SIGNATURE);
+#
+# With --partition the table is written as a binary image for a data
+# partition instead (WM_FEATURE_PARTITION_TABLE), flash it with
+#
+#   parttool.py write_partition --partition-name wifiman --input wifiman.bin
+#
+# and load it with wifiman_loadPartitionNetworks(data, "wifiman").
+#
+# With --pmk the passwords are replaced by the precomputed WPA2 PMK (64 hex
+# digits), so the plain passphrases are not part of the firmware and the
+# PBKDF2 run on connect is skipped. Not usable with WPA3 (SAE) networks.
+
+import argparse
+import csv
+import hashlib
+import struct
+import sys
+
+MAX_NETWORKS = 254
+
+# see WM_PartitionHeader and WM_PartitionRecord in wifi_manager.cpp
+PARTITION_MAGIC = 0x544e4d57
+PARTITION_VERSION = 1
+PARTITION_RECORD = struct.Struct('<33s65s2x')
+
+
+def c_string(value):
+    result = '"'
+    for byte in value.encode('utf-8'):
+        char = chr(byte)
+        if char in '"\\':
+            result += '\\' + char
+        elif 0x20 <= byte < 0x7f:
+            result += char
+        else:
+            # keep following hex digits out of the escape
+            result += '\\%03o' % byte
+    return result + '"'
+
+
+def fnv1a(data, value=0x811c9dc5):
+    for byte in data:
+        value = ((value ^ byte) * 0x01000193) & 0xffffffff
+    return value
+
+
+def pmk(ssid, passphrase):
+    return hashlib.pbkdf2_hmac('sha1', passphrase.encode('utf-8'), ssid.encode('utf-8'), 4096, 32).hex()
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Generate a wifiman factory network table')
+    parser.add_argument('csv', help='ssid,password per line')
+    parser.add_argument('--partition', metavar='FILE', help='write a partition image instead of a header')
+    parser.add_argument('--pmk', action='store_true', help='store the WPA2 PMK instead of the passphrase')
+    args = parser.parse_args()
+
+    networks = []
+    with open(args.csv, newline='', encoding='utf-8') as file:
+        for line, row in enumerate(csv.reader(file), 1):
+            if not row or row[0].startswith('#'):
+                continue
+
+            ssid = row[0]
+            password = row[1] if len(row) > 1 else ''
+
+            if not 0 < len(ssid.encode('utf-8')) <= 32:
+                sys.exit('line %d: SSID must have 1 to 32 bytes' % line)
+            if password and not 8 <= len(password.encode('utf-8')) <= 64:
+                sys.exit('line %d: password must have 8 to 64 bytes' % line)
+            if any(ssid == existing for existing, _ in networks):
+                sys.exit('line %d: duplicate SSID %s' % (line, ssid))
+
+            if args.pmk and password and len(password) != 64:
+                password = pmk(ssid, password)
+
+            networks.append((ssid, password))
+
+    if not networks:
+        sys.exit('no networks in %s' % args.csv)
+    if len(networks) > MAX_NETWORKS:
+        sys.exit('at most %d networks are supported' % MAX_NETWORKS)
+
+    # The overlay in NVS is stored by table index, so a changed table order
+    # or SSID must discard it. So does a changed password: its FAILED_BEFORE
+    # state or password override would keep the fixed entry from being used
+    signature = 0x811c9dc5
+    for ssid, password in networks:
+        signature = fnv1a(ssid.encode('utf-8') + b'\0' + password.encode('utf-8') + b'\0', signature)
+
+    if args.partition:
+        with open(args.partition, 'wb') as file:
+            file.write(struct.pack('<IHHHHI', PARTITION_MAGIC, PARTITION_VERSION, PARTITION_RECORD.size,
+                                   len(networks), 0, signature))
+            for ssid, password in networks:
+                file.write(PARTITION_RECORD.pack(ssid.encode('utf-8'), password.encode('utf-8')))
+        return
+
+    print('// Generated by tools/wifiman_factory.py, do not edit')
+    print('#pragma once')
+    print()
+    print('#include "wifi_manager.h"')
+    print()
+    print('#define WM_FACTORY_NETWORK_COUNT %d' % len(networks))
+    print('#define WM_FACTORY_NETWORK_SIGNATURE 0x%08xul' % signature)
+    print()
+    print('static constexpr WM_FactoryNetwork WM_FACTORY_NETWORKS[WM_FACTORY_NETWORK_COUNT] = {')
+    for ssid, password in networks:
+        print('    { %s, %s },' % (c_string(ssid), c_string(password) if password else 'nullptr'))
+    print('};')
+
+
+if __name__ == '__main__':
+    main()
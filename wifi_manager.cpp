@@ -1,37 +1,473 @@
 #include "wifi_manager.h"
+#include "wifi_manager_policy.h"
 
+#if WM_FEATURE_PERSISTENCE
 #include <Preferences.h>
+#endif
+#if WM_FEATURE_PARTITION_TABLE
+#include <esp_partition.h>
+#endif
+#if WM_FEATURE_ROAMING
+#include <esp_rrm.h>
+#endif
+#if WM_FEATURE_PMK_CACHE
+#include <mbedtls/md.h>
+#include <mbedtls/pkcs5.h>
+#endif
+#if WM_FEATURE_WATCHDOG
+#include <esp_timer.h>
+#endif
 
 typedef unsigned long ArduinoTime_t;
 
+#if WM_FEATURE_DIAGNOSTICS
+#define WM_LOG(...) Serial.printf(__VA_ARGS__)
+#else
+#define WM_LOG(...)
+#endif
+
+#if WM_FEATURE_TRACE
+#define WM_TRACE(type, phase, arg) _wifiman_trace(type, phase, arg, WM_TRACE_LANE_AUTO)
+#define WM_TRACE_RADIO(type, phase, arg) _wifiman_trace(type, phase, arg, WM_TRACE_LANE_RADIO)
+// Begin/end event spanning the rest of the current scope
+#define WM_TRACE_SCOPE(type, arg) _WM_TraceScope _wm_traceScope(type, arg)
+// Same as WM_TRACE_SCOPE, use at the start of all WiFi event handlers
+#define WM_TRACE_EVENT(type, arg) _wifiman_eventTaskHandle = xTaskGetCurrentTaskHandle(); WM_TRACE_SCOPE(type, arg)
+#else
+#define WM_TRACE(type, phase, arg) ((void)0)
+#define WM_TRACE_RADIO(type, phase, arg) ((void)0)
+#define WM_TRACE_SCOPE(type, arg)
+#define WM_TRACE_EVENT(type, arg)
+#endif
+
+#if WM_FEATURE_METRICS
+#define WM_METRIC_INC(name) (++_wifiman_metrics.name)
+#else
+#define WM_METRIC_INC(name) ((void)0)
+#endif
+
+#if WM_FEATURE_POWER_SAVE
+// Radio activities which need the modem awake (plus "associated")
+#define WM_RADIO_SCANNING 0x01
+#define WM_RADIO_CONNECTING 0x02
+#define WM_RADIO_PROBING 0x04
+#define WM_RADIO_ASSOCIATED 0x08
+#define WM_SET_RADIO_FLAG(flag, set) _wifiman_setRadioFlag(flag, set)
+#else
+#define WM_SET_RADIO_FLAG(flag, set) ((void)0)
+#endif
+
+#if WM_FEATURE_PERSISTENCE
 #define WM_PREFERENCES_NAMESPACE "wifiman" // max 15 chars
 #define WM_PREFERENCES_KEY_SSID "ssid%d" // max 15 chars
 #define WM_PREFERENCES_KEY_PASS "pass%d"
 #define WM_PREFERENCES_KEY_STATE "stat%d"
+#define WM_PREFERENCES_KEY_FACTORY_SIGNATURE "wmfsig"
+#define WM_PREFERENCES_KEY_FACTORY_OVERLAY "wmfstate"
+#define WM_PREFERENCES_KEY_FACTORY_PASS "wmfp%d"
+#endif
 
-#define WM_SCAN_MAX_AGE_MS 60000
 
 static WM_SharedData* _wifiman_data = nullptr;
+// Copy of _wifiman_data->status for wifiman_getStatusFromISR, always written
+// as a whole (aligned 32 bit stores are atomic)
+typedef union _WM_StatusWord {
+    uint32_t word;
+    WM_Status status;
+} _WM_StatusWord;
+static_assert(sizeof(WM_Status) == sizeof(uint32_t), "WM_Status must fit into one word");
+static uint32_t _wifiman_statusWord = 0x000000FF; // targetNetwork -1, WM_IDLE_STATUS
+#if WM_FEATURE_AUTOCONNECT
 static bool _wifiman_autoConnect = false;
+#else
+static const bool _wifiman_autoConnect = false;
+#endif
 static uint32_t _wifiman_scanInterval = WM_SCAN_INTERVAL_DEFAULT_MS;
+#if WM_FEATURE_WORKER
 static TaskHandle_t _wifiman_workerTaskHandle = nullptr;
+#endif
 static WM_StatusChangeCallback _wifiman_statusCallback = nullptr;
 static uint8_t _wifiman_maxRetries = WM_RETRIES_DEFAULT;
+static uint32_t _wifiman_scanMaxAge = WM_SCAN_MAX_AGE_DEFAULT_MS;
+static uint32_t _wifiman_backoffBase = WM_BACKOFF_BASE_DEFAULT_MS;
+static uint32_t _wifiman_backoffMax = WM_BACKOFF_MAX_DEFAULT_MS;
+
+#if WM_FEATURE_UPLINK_PROBE
+static WM_UplinkProbeMode _wifiman_probeMode = WM_PROBE_NONE;
+static char *_wifiman_probeHost = nullptr;
+static char *_wifiman_probePath = nullptr;
+static uint16_t _wifiman_probePort = WM_PROBE_PORT_DEFAULT;
+static uint16_t _wifiman_probeTimeout = WM_PROBE_TIMEOUT_DEFAULT_MS;
+#endif
 
 static ArduinoTime_t _wifiman_scanTime = 0;
 static uint8_t _wifiman_retryCount = 0;
 
-static void _wifiman_checkConnection();
+static bool _wifiman_scanPassive = false;
+static uint16_t _wifiman_scanMsPerChannel = WM_SCAN_MS_PER_CHANNEL_DEFAULT;
+
+#if WM_FEATURE_TRACE
+#define WM_TRACE_LANE_AUTO 0xFF
+
+static WM_TraceEvent _wifiman_traceBuffer[WM_TRACE_BUFFER_SIZE];
+static uint16_t _wifiman_traceNext = 0;
+static bool _wifiman_traceWrapped = false;
+static bool _wifiman_traceEnabled = true;
+static portMUX_TYPE _wifiman_traceMux = portMUX_INITIALIZER_UNLOCKED;
+// Arduino event task, set on first event (we do not create it ourselves)
+static TaskHandle_t _wifiman_eventTaskHandle = nullptr;
+// WM_TRACE_RADIO_CONNECT began and did not end yet
+static bool _wifiman_traceConnectOpen = false;
+
+static const char *_wifiman_traceNames[] = {
+    "scan cmd issued",
+    "connect cmd issued",
+    "scan cmd picked up",
+    "connect cmd picked up",
+    "scan cmd exec",
+    "connect cmd exec",
+    "uplink probe",
+    "STA_CONNECTED",
+    "STA_DISCONNECTED",
+    "STA_GOT_IP",
+    "SCAN_DONE",
+    "status callback",
+    "wait nextScan.lock",
+    "wait nextConnect.lock",
+    "scan",
+    "connect",
+    "link lost",
+};
+
+static const char *_wifiman_traceLaneNames[] = {
+    "app",
+    "wifiman worker",
+    "arduino events",
+    "radio",
+};
+
+static void _wifiman_trace(WM_TraceType type, char phase, uint8_t arg, uint8_t lane);
+
+struct _WM_TraceScope
+{
+    WM_TraceType type;
+    uint8_t arg;
+
+    _WM_TraceScope(WM_TraceType type, uint8_t arg) : type(type), arg(arg) { WM_TRACE(type, 'B', arg); }
+    ~_WM_TraceScope() { WM_TRACE(type, 'E', arg); }
+};
+#endif
+
+static ArduinoTime_t _wifiman_connectRequestTime = 0; // 0 = no request pending
+
+#define WM_WORKER_PRIORITY 1
+// The command loop alone peaks at 1828 - 1940 bytes. The deepest paths add
+// their library frames on top of that: uplink probe (DNS, TCP and HTTP in
+// WiFiClient), PBKDF2 (PMK cache), NVS reads (boot list load) and the STA
+// driver reinit (watchdog), each plus WM_LOG (printf). Check
+// wifiman_worker_stack_free_bytes when changing features.
+#ifndef WM_WORKER_STACK_SIZE
+#define WM_WORKER_STACK_SIZE 4608
+#endif
+
+#if WM_FEATURE_WATCHDOG
+#define WM_WATCHDOG_BOOST_PRIORITY 5
+#define WM_WATCHDOG_CHECK_MS 1000
+// All channels of any region, the scan deadline is their dwell time plus
+// WM_WATCHDOG_SCAN_MS
+#define WM_WATCHDOG_SCAN_CHANNELS 14
+
+typedef enum _WM_Recovery : uint8_t {
+    WM_RECOVERY_ABORT_SCAN = 0,
+    WM_RECOVERY_RESTART_CONNECT,
+    WM_RECOVERY_REINIT_DRIVER,
+    WM_RECOVERY_BOOST_WORKER,
+    WM_RECOVERY_COUNT
+} _WM_Recovery;
+
+static esp_timer_handle_t _wifiman_watchdogTimer = nullptr;
+static ArduinoTime_t _wifiman_workerHeartbeat = 0; // last worker loop iteration
+static bool _wifiman_workerBoosted = false;
+static ArduinoTime_t _wifiman_watchdogCheckTime = 0;
+static ArduinoTime_t _wifiman_scanRunningSince = 0; // 0 = no scan running
+static ArduinoTime_t _wifiman_attemptStartTime = 0; // 0 = no attempt waiting for GOT_IP
+static uint8_t _wifiman_watchdogStrikes = 0; // recoveries without progress in between
+static bool _wifiman_ownDisconnect = false; // an ASSOC_LEAVE of ours is pending
+#endif
+
+#if WM_FEATURE_METRICS
+// upper bounds of the time to connect histogram buckets (+Inf is implicit)
+static const uint32_t _wifiman_ttcBucketsMs[] = { 1000, 2000, 5000, 10000, 20000, 30000, 60000 };
+static const char *_wifiman_ttcBucketNames[] = { "1", "2", "5", "10", "20", "30", "60", "+Inf" };
+#define WM_TTC_BUCKETS (sizeof(_wifiman_ttcBucketsMs) / sizeof(_wifiman_ttcBucketsMs[0]) + 1)
+
+struct _WM_Metrics
+{
+    uint32_t scans;
+    uint32_t connectAttempts;
+    uint32_t connectSuccesses;
+    uint32_t retries;
+    uint32_t workerWakeups;
+#if WM_FEATURE_WATCHDOG
+    uint32_t recoveries[WM_RECOVERY_COUNT];
+#endif
+    uint32_t timeToConnect[WM_TTC_BUCKETS]; // not cumulative
+    uint64_t timeToConnectSumMs;
+};
+
+static _WM_Metrics _wifiman_metrics = {};
+// commands picked up by the worker, but not yet executed (i.e. delayed reconnects)
+static uint8_t _wifiman_scheduledCommands = 0;
+#endif
+
+#if WM_FEATURE_PMK_CACHE
+typedef struct _WM_PMKEntry {
+    uint32_t key; // hash of SSID and passphrase (0 = unused)
+    uint32_t lastUsed; // for least recently used replacement
+    uint8_t pmk[32];
+} _WM_PMKEntry;
+
+// Kept in RTC memory, so a wake up from deep sleep does not derive it again
+RTC_DATA_ATTR static _WM_PMKEntry _wifiman_pmkCache[WM_PMK_CACHE_SIZE];
+RTC_DATA_ATTR static uint32_t _wifiman_pmkUseCounter;
+static uint8_t _wifiman_pmkPending = -1; // network to derive the PMK for (worker)
+static bool _wifiman_pmkUsed = false; // current attempt uses a cached PMK
+// The cache is read by the event task and written by the worker
+static portMUX_TYPE _wifiman_pmkMux = portMUX_INITIALIZER_UNLOCKED;
+#endif
+
+#if WM_FEATURE_FACTORY_TABLE
+#define WM_FACTORY_COUNT(data) ((data)->factoryCount)
+// Overlay byte per factory table entry: (state + 1) | flags
+#define WM_FACTORY_OVERLAY_STATE 0x0F
+#define WM_FACTORY_OVERLAY_PASS 0x40 // password changed, see WM_PREFERENCES_KEY_FACTORY_PASS
+#define WM_FACTORY_OVERLAY_DELETED 0x80
+
+static uint8_t _wifiman_factoryTableSize = 0;
+static uint32_t _wifiman_factorySignature = 0;
+static bool _wifiman_factoryOverlayDirty = false; // factory network deleted
+#define WM_OWNS_SSID(network) ((network)->factoryIndex == (uint8_t)-1)
+#define WM_OWNS_PASS(network) (! (network)->constPass)
+#else
+#define WM_FACTORY_COUNT(data) 0
+#define WM_OWNS_SSID(network) true
+#define WM_OWNS_PASS(network) true
+#endif
+
+#if WM_FEATURE_PARTITION_TABLE
+// Flat table written by tools/wifiman_factory.py --partition (little endian)
+#define WM_PARTITION_MAGIC 0x544E4D57 // "WMNT"
+#define WM_PARTITION_VERSION 1
+
+typedef struct WM_PartitionHeader {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t recordSize;
+    uint16_t count;
+    uint16_t reserved;
+    uint32_t signature; // of SSIDs and passwords, see wifiman_loadFactoryNetworks
+} WM_PartitionHeader;
+
+typedef struct WM_PartitionRecord {
+    char ssid[33];
+    char pass[65]; // empty for open networks
+    uint8_t reserved[2];
+} WM_PartitionRecord;
+
+static_assert(sizeof(WM_PartitionHeader) == 16, "wifiman: partition header layout");
+static_assert(sizeof(WM_PartitionRecord) == 100, "wifiman: partition record layout");
+
+static const WM_PartitionRecord *_wifiman_partitionMap = nullptr;
+#endif
+
+#if WM_FEATURE_FAST_SCAN
+static bool _wifiman_fastScan = false;
+static int _wifiman_fastScanGoodScore = WM_FAST_SCAN_GOOD_SCORE_DEFAULT;
+static bool _wifiman_fastScanFinishLater = false;
+static bool _wifiman_sweepRequested = false; // next scan is done as channel sweep
+static bool _wifiman_sweepActive = false;
+static uint8_t _wifiman_sweepChannels[WM_SCAN_CHANNELS]; // in visiting order
+static uint8_t _wifiman_sweepLength = 0;
+static uint8_t _wifiman_sweepPos = 0;
+static WM_NetworkSet _wifiman_sweepInRange = {}; // over all channels visited so far
+static int8_t _wifiman_sweepRSSI[UINT8_MAX]; // strongest per network in _wifiman_sweepInRange
+static uint8_t _wifiman_sweepBestIndex = -1;
+static int _wifiman_sweepBestScore = INT_MIN;
+static bool _wifiman_sweepPartial = false; // ended early, channels were skipped
+// Scan generation the sweep result belongs to (results of the last channel)
+static uint32_t _wifiman_sweepGeneration = 0;
+#endif
+
+#if WM_FEATURE_PERSISTENCE && WM_FEATURE_AUTOCONNECT
+// wifiman_startAsync: list load and first scan still running (joined at 0)
+static uint8_t _wifiman_bootPending = 0;
+static bool _wifiman_bootLoad = false; // worker has to load the list first
+#endif
+
+#if WM_FEATURE_WAITERS
+static WM_Waiter *_wifiman_waiters = nullptr;
+static portMUX_TYPE _wifiman_waiterMux = portMUX_INITIALIZER_UNLOCKED;
+#endif
+
+#if WM_FEATURE_SORTED_INDEX
+// Lookups run in the event task as well, so data->sorted, the entries of
+// data->networks it points to and data->length are only changed while
+// holding this (free removed entries after releasing it)
+static portMUX_TYPE _wifiman_indexMux = portMUX_INITIALIZER_UNLOCKED;
+#endif
+
+#if WM_FEATURE_POWER_SAVE
+static bool _wifiman_powerSaveManaged = false;
+static wifi_ps_type_t _wifiman_powerSaveIdle = WIFI_PS_MIN_MODEM;
+static int8_t _wifiman_powerSaveCurrent = -1; // -1 = unknown, set on next update
+static uint8_t _wifiman_radioFlags = 0;
+static uint8_t _wifiman_highPerformanceRequests = 0;
+#endif
+
+#if WM_FEATURE_ENERGY
+static WM_PowerModel _wifiman_powerModel = { {
+    WM_POWER_SCAN_ACTIVE_DEFAULT_MW, 
+    WM_POWER_SCAN_PASSIVE_DEFAULT_MW, 
+    WM_POWER_CONNECT_DEFAULT_MW, 
+    WM_POWER_CONNECTED_DEFAULT_MW 
+} };
+static WM_EnergyStats _wifiman_energyStats = {};
+static ArduinoTime_t _wifiman_activityStart[WM_ACTIVITY_COUNT] = {}; // 0 = not running
+static uint64_t _wifiman_scanBudgetUJ = 0; // 0 = no budget
+static uint32_t _wifiman_scanBudgetPeriod = 0;
+static ArduinoTime_t _wifiman_scanBudgetStart = 0;
+static uint64_t _wifiman_scanBudgetSpentUJ = 0;
+#endif
+
+#if WM_FEATURE_DIAGNOSTICS
+static WM_RadioStats _wifiman_radioStats = {};
+static ArduinoTime_t _wifiman_scanStartTime = 0;
+static bool _wifiman_scanStartPassive = false;
+static ArduinoTime_t _wifiman_associationStartTime = 0;
+static ArduinoTime_t _wifiman_connectedTime = 0;
+static int8_t _wifiman_attemptRSSIBucket = -1;
+#endif
+
+// Increased on every SCAN_DONE event
+static uint32_t _wifiman_scanGeneration = 0;
+// Network index of each scan result (or -1), so SSIDs only need to be
+// looked up once per scan instead of on every call
+static uint8_t *_wifiman_scanMap = nullptr;
+static uint8_t _wifiman_scanMapSize = 0;
+static uint8_t _wifiman_scanMapLength = 0;
+static uint32_t _wifiman_scanMapGeneration = 0;
+static bool _wifiman_scanMapValid = false;
+// Scan results grouped by SSID, built with the map (same size)
+static WM_ScanGroup *_wifiman_scanGroups = nullptr;
+static uint8_t *_wifiman_scanGroupOf = nullptr; // group of each scan result
+static uint8_t _wifiman_scanGroupCount = 0;
+// Guards the scan result and everything above built from it, used by the
+// event task, the worker and the application (see wifiman_lockScanResults)
+static SemaphoreHandle_t _wifiman_scanLock = nullptr;
+
+struct _WM_ScanLock
+{
+    _WM_ScanLock() { wifiman_lockScanResults(); }
+    ~_WM_ScanLock() { wifiman_unlockScanResults(); }
+};
+#define WM_SCAN_LOCK() _WM_ScanLock _wm_scanLock
+
+#if WM_FEATURE_PERSISTENCE
+static WM_StorageStats _wifiman_storageStats = {};
+#endif
+
 static void _wifiman_wifiConnectedEvent(arduino_event_t *event);
 static void _wifiman_wifiDisconnectedEvent(arduino_event_t *event);
+static void _wifiman_wifiGotIPEvent(arduino_event_t *event);
+#if WM_FEATURE_AUTOCONNECT
+static void _wifiman_checkConnection();
 static void _wifiman_wifiScanDoneEvent(arduino_event_t *event);
-static void _wifiman_workerTask(void *parameters);
 static void _wifiman_scanResume();
 static void _wifiman_scanPause();
+#endif
+#if WM_FEATURE_WORKER
+static void _wifiman_workerTask(void *parameters);
+#endif
+#if WM_FEATURE_PERSISTENCE && WM_FEATURE_AUTOCONNECT
+static void _wifiman_bootLoadList();
+static void _wifiman_bootDone();
+#endif
 static void _wifiman_doScan(ArduinoTime_t when);
 static void _wifiman_connect(uint8_t index, bool byUser, ArduinoTime_t when);
+static bool _wifiman_startScan(uint8_t channel = 0);
+static void _wifiman_beginConnect(uint8_t index);
+#if WM_FEATURE_FAST_SCAN
+static bool _wifiman_beginSweep();
+static bool _wifiman_continueSweep();
+#endif
+#if WM_FEATURE_ROAMING
+static void _wifiman_neighborReport(void *context, const uint8_t *report, size_t length);
+#endif
+#if WM_FEATURE_PMK_CACHE
+static bool _wifiman_hasPMK(const WM_WifiNetwork *network);
+static void _wifiman_dropPMK(const WM_WifiNetwork *network);
+static const char* _wifiman_connectPass(uint8_t index, char pmkHex[65]);
+static void _wifiman_derivePMK(uint8_t index);
+#endif
+#if WM_FEATURE_WATCHDOG
+static void _wifiman_watchdogCheck();
+static void _wifiman_watchdogTimerCallback(void *context);
+static void _wifiman_recover(_WM_Recovery action);
+#endif
+#if WM_FEATURE_DIAGNOSTICS
+static void _wifiman_addTiming(WM_TimingStat *stat, ArduinoTime_t start);
+static int8_t _wifiman_rssiBucket(uint8_t index);
+#endif
+#if WM_FEATURE_UPLINK_PROBE
+static void _wifiman_probe(uint8_t index);
+static void _wifiman_runUplinkProbe(uint8_t index);
+#endif
+#if WM_FEATURE_POWER_SAVE
+static void _wifiman_setRadioFlag(uint8_t flag, bool set);
+static void _wifiman_updatePowerSave();
+#endif
+#if WM_FEATURE_ENERGY
+static void _wifiman_beginActivity(WM_Activity activity);
+static void _wifiman_endActivity(WM_Activity activity);
+static bool _wifiman_scanBudgetExhausted();
+#endif
+static void _wifiman_notifyStatus(WM_SharedData *data);
+static void _wifiman_publishStatus(WM_SharedData *data);
+#if WM_FEATURE_WAITERS
+static void _wifiman_fireWaiters(WM_WaitEvent event, const WM_Status *status);
+#endif
+static WM_WifiNetwork* _wifiman_allocNetwork();
+static void _wifiman_freeNetwork(WM_WifiNetwork *network);
+static void _wifiman_setPass(WM_SharedData *data, WM_WifiNetwork *network, const char *pass);
+static char* _wifiman_internPass(WM_SharedData *data, const char *pass);
+static void _wifiman_releasePass(char *pass);
+#if WM_FEATURE_FACTORY_TABLE
+static void _wifiman_factoryEntry(const void *table, uint8_t index, const char **ssid, const char **pass);
+static uint8_t _wifiman_loadConstNetworks(WM_SharedData *data, const void *table, uint8_t count, uint32_t signature,
+        void (*entry)(const void *table, uint8_t index, const char **ssid, const char **pass));
+#if WM_FEATURE_PERSISTENCE
+static void _wifiman_saveFactoryOverlay(WM_SharedData *data, bool onlyChanged);
+#endif
+#endif
+#if WM_FEATURE_PARTITION_TABLE
+static void _wifiman_partitionEntry(const void *table, uint8_t index, const char **ssid, const char **pass);
+#endif
+static void _wifiman_setState(WM_SharedData *data, uint8_t index, WM_NetworkWorkingState state);
+static void _wifiman_setUplink(WM_SharedData *data, uint8_t index, WM_UplinkState uplink);
+static void _wifiman_rebuildSets(WM_SharedData *data);
+#if WM_FEATURE_SORTED_INDEX
+static uint8_t _wifiman_searchSorted(WM_SharedData *data, const char *key, size_t prefixLength, bool upper);
+static void _wifiman_sortIndex(WM_SharedData *data, uint8_t length, uint8_t *sorted);
+static void _wifiman_rebuildIndex(WM_SharedData *data);
+#endif
+static inline void _wifiman_markDirty(WM_SharedData *data, uint8_t index);
+static bool _wifiman_updateScanMap(WM_SharedData *data);
+static inline void _wifiman_setBit(WM_NetworkSet *set, uint8_t index, bool value);
+static inline bool _wifiman_testBit(const WM_NetworkSet *set, uint8_t index);
+static void _wifiman_removeBit(WM_NetworkSet *set, uint8_t index);
 static inline bool _time_now_or_passed(ArduinoTime_t timeToTest, ArduinoTime_t now);
 
+#if WM_FEATURE_WORKER
 struct _WM_WifiConnect
 {
     SemaphoreHandle_t lock;
@@ -50,6 +486,17 @@ struct _WM_WifiScan
 
 _WM_WifiConnect nextConnect;
 _WM_WifiScan nextScan;
+#endif
+
+#if WM_FEATURE_UPLINK_PROBE
+struct _WM_UplinkProbe
+{
+    uint8_t networkIndex = 0;
+    bool handled = true; // make sure to set this last when issueing new command
+};
+
+_WM_UplinkProbe nextProbe;
+#endif
 
 WM_SharedData* wifiman_create(WM_WifiNetwork **networkList, uint8_t capacity)
 {
@@ -67,6 +514,7 @@ WM_SharedData* wifiman_create(WM_WifiNetwork **networkList, uint8_t capacity)
     }
     else
     {
+        result->length = capacity;
         for (int i = 0; i < capacity; ++i)
         {
             if (networkList[i] != nullptr)
@@ -78,9 +526,57 @@ WM_SharedData* wifiman_create(WM_WifiNetwork **networkList, uint8_t capacity)
     }
     result->networks = networkList;
     result->capacity = capacity;
+#if WM_FEATURE_SORTED_INDEX
+    result->sorted = (uint8_t*)malloc(capacity);
+#endif
+
+    // Passwords of an existing list were allocated by the caller, swap them
+    // for shared copies (only networks before i are candidates for sharing)
+    uint8_t length = result->length;
+    for (int i = 0; i < length; ++i)
+    {
+        // Only ssid, pass and state are the caller's, entries allocated with
+        // malloc(sizeof(WM_WifiNetwork)) hold garbage in all other members
+        WM_WifiNetwork *network = networkList[i];
+        network->uplink = UPLINK_STATE_UNKNOWN;
+        network->uplinkRTT = 0;
+        network->channel = 0;
+#if WM_FEATURE_ROAMING
+        network->neighborChannels = 0;
+#endif
+#if WM_FEATURE_FACTORY_TABLE
+        network->factoryIndex = -1;
+        network->constPass = false;
+#endif
+#if WM_FEATURE_METRICS
+        network->connectAttempts = 0;
+        network->connectSuccesses = 0;
+#endif
+
+        char *pass = network->pass;
+        result->length = i;
+        network->pass = _wifiman_internPass(result, pass);
+        free(pass);
+    }
+    result->length = length;
+
+#if WM_FEATURE_FACTORY_TABLE
+    result->factoryCount = 0;
+#endif
 
     result->status.targetNetwork = -1;
     result->status.code = WM_IDLE_STATUS;
+    result->status.connectAttempts = 0;
+    result->status.generation = 0;
+
+    _wifiman_rebuildSets(result);
+
+#if WM_FEATURE_PERSISTENCE
+    // nothing of a passed list has been saved by us
+    memset(&result->dirty, 0, sizeof(result->dirty));
+    for (int i = 0; i < result->length; ++i)
+        _wifiman_markDirty(result, i);
+#endif
 
     return result;
 }
@@ -90,6 +586,10 @@ void wifiman_free(WM_SharedData *data)
     if (data == nullptr)
         return;
 
+#if WM_FEATURE_SORTED_INDEX
+    free(data->sorted);
+#endif
+
     if (data->networks == nullptr)
     {
         free(data);
@@ -97,11 +597,7 @@ void wifiman_free(WM_SharedData *data)
     }
 
     for (int i = 0; i < data->length; ++i)
-    {
-        free(data->networks[i]->ssid);
-        free(data->networks[i]->pass);
-        free(data->networks[i]);
-    }
+        _wifiman_freeNetwork(data->networks[i]);
 
     free(data->networks);
     free(data);
@@ -109,6 +605,47 @@ void wifiman_free(WM_SharedData *data)
     return;
 }
 
+size_t wifiman_getMemoryUsage(WM_SharedData *data, size_t *sharedBytes)
+{
+    if (data == nullptr)
+        return 0;
+
+    size_t result = sizeof(WM_SharedData) + sizeof(data->networks[0]) * data->capacity;
+#if WM_FEATURE_SORTED_INDEX
+    result += data->capacity;
+#endif
+
+    size_t shared = 0;
+
+    for (int i = 0; i < data->length; ++i)
+    {
+        WM_WifiNetwork *network = data->networks[i];
+        result += sizeof(WM_WifiNetwork);
+
+        // strings of factory networks are in flash
+        if (WM_OWNS_SSID(network))
+            result += strlen(network->ssid) + 1;
+
+        if (network->pass == nullptr || ! WM_OWNS_PASS(network))
+            continue;
+
+        // an interned password is counted for its first network only
+        bool first = true;
+        for (int j = 0; j < i && first; ++j)
+            first = (data->networks[j]->pass != network->pass);
+
+        if (first)
+            result += strlen(network->pass) + 2; // + reference count
+        else
+            shared += strlen(network->pass) + 1;
+    }
+
+    if (sharedBytes != nullptr)
+        *sharedBytes = shared;
+
+    return result;
+}
+
 void wifiman_start(WM_SharedData *data, bool autoConnect, WM_StatusChangeCallback callback, uint32_t scanInterval)
 {
     assert(data != nullptr);
@@ -118,20 +655,32 @@ void wifiman_start(WM_SharedData *data, bool autoConnect, WM_StatusChangeCallbac
     assert(temp != 0);
     temp = WiFi.onEvent(_wifiman_wifiDisconnectedEvent, ARDUINO_EVENT_WIFI_STA_DISCONNECTED);
     assert(temp != 0);
+    temp = WiFi.onEvent(_wifiman_wifiGotIPEvent, ARDUINO_EVENT_WIFI_STA_GOT_IP);
+    assert(temp != 0);
+    _wifiman_scanLock = xSemaphoreCreateRecursiveMutex();
     _wifiman_data = data;
-    _wifiman_autoConnect = autoConnect;
     _wifiman_scanInterval = scanInterval;
     _wifiman_statusCallback = callback;
+    _wifiman_publishStatus(data);
 
+#if WM_FEATURE_WORKER
     nextConnect.handled = true;
     nextScan.handled = true;
     nextConnect.lock = xSemaphoreCreateMutex();
     nextScan.lock = xSemaphoreCreateMutex();
+#endif
+#if WM_FEATURE_UPLINK_PROBE
+    nextProbe.handled = true;
+#endif
+
+#if WM_FEATURE_AUTOCONNECT
+    _wifiman_autoConnect = autoConnect;
+
+    temp = WiFi.onEvent(_wifiman_wifiScanDoneEvent, ARDUINO_EVENT_WIFI_SCAN_DONE);
+    assert(temp != 0);
 
     if (_wifiman_autoConnect)
     {
-        WiFi.onEvent(_wifiman_wifiScanDoneEvent, ARDUINO_EVENT_WIFI_SCAN_DONE);
-        
         // We need to disable auto reconnect, else it interferes with our autoConnect
         // The auto reconnect calls WiFi.disconnect and WiFi.begin on each disconnect 
         // event (WiFiGeneric.cpp:975), which will stop/invalidate our background 
@@ -139,142 +688,557 @@ void wifiman_start(WM_SharedData *data, bool autoConnect, WM_StatusChangeCallbac
         // This will still happen once each startup because of WiFiGeneric.cpp:966
         WiFi.setAutoReconnect(false);
     }
+#endif
 
+#if WM_FEATURE_WORKER
     xTaskCreatePinnedToCore(
             _wifiman_workerTask,
             "WifimanWorker",
-            3072, // watermark shows max. 1828 - 1940 bytes usage
+            WM_WORKER_STACK_SIZE,
             nullptr,
-            1,
+            WM_WORKER_PRIORITY,
             &_wifiman_workerTaskHandle,
             0);
+#endif
+
+#if WM_FEATURE_WATCHDOG
+    // Watches the worker from the esp_timer task, the worker watches the rest
+    _wifiman_workerHeartbeat = millis();
+    esp_timer_create_args_t args = {};
+    args.callback = &_wifiman_watchdogTimerCallback;
+    args.name = "wifiman_watchdog";
+    esp_timer_create(&args, &_wifiman_watchdogTimer);
+    esp_timer_start_periodic(_wifiman_watchdogTimer, WM_WATCHDOG_CHECK_MS * 1000ull);
+#endif
+}
+
+#if WM_FEATURE_PERSISTENCE && WM_FEATURE_AUTOCONNECT
+void wifiman_startAsync(WM_SharedData *data, bool autoConnect, WM_StatusChangeCallback callback, uint32_t scanInterval)
+{
+    assert(data != nullptr);
+    assert(data->length == WM_FACTORY_COUNT(data));
+
+    _wifiman_bootPending = 2;
+    _wifiman_bootLoad = true;
+
+    // creates the worker, which starts with loading the list
+    wifiman_start(data, autoConnect, callback, scanInterval);
+
+    // speculative scan, not through the worker, it is busy with the list
+    if (! _wifiman_startScan())
+        _wifiman_bootDone();
+}
+
+// Runs in the worker: read the list into a separate structure, so event
+// handlers never see a half loaded list
+static void _wifiman_bootLoadList()
+{
+    WM_SharedData *data = _wifiman_data;
+    // user networks follow the factory networks, which are loaded already
+    uint8_t first = data->length;
+    WM_SharedData *loaded = wifiman_create(nullptr, data->capacity - first);
+    if (loaded == nullptr)
+    {
+        _wifiman_bootDone();
+        return;
+    }
+
+    uint8_t count = wifiman_readFromEEPROM(loaded);
+
+    WM_LOG("[WIFIMAN-THREAD] Boot: %d networks loaded\n", count);
+
+    for (int i = 0; i < count; ++i)
+        data->networks[first + i] = loaded->networks[i];
+#if WM_FEATURE_SORTED_INDEX
+    // publish the length together with a complete index for it
+    uint8_t sorted[UINT8_MAX];
+    _wifiman_sortIndex(data, first + count, sorted);
+    portENTER_CRITICAL(&_wifiman_indexMux);
+    memcpy(data->sorted, sorted, first + count);
+    __atomic_store_n(&data->length, first + count, __ATOMIC_RELEASE);
+    portEXIT_CRITICAL(&_wifiman_indexMux);
+#else
+    __atomic_store_n(&data->length, first + count, __ATOMIC_RELEASE);
+#endif
+    {
+        // the SCAN_DONE of the speculative scan might be mapping or reading
+        // the sets right now
+        WM_SCAN_LOCK();
+        _wifiman_rebuildSets(data);
+        // a scan result might have been mapped against the empty list
+        _wifiman_scanMapValid = false;
+    }
+    memset(&data->dirty, 0, sizeof(data->dirty));
+
+    // networks are owned by data now
+    loaded->length = 0;
+    wifiman_free(loaded);
+
+    _wifiman_bootDone();
+}
+
+// List load or first scan finished, the last one connects
+static void _wifiman_bootDone()
+{
+    if (__atomic_sub_fetch(&_wifiman_bootPending, 1, __ATOMIC_ACQ_REL) != 0)
+        return;
+
+    WM_LOG("[WIFIMAN] Boot: list and scan ready\n");
+#if WM_FEATURE_WAITERS
+    WM_Status status = _wifiman_data->status;
+    _wifiman_fireWaiters(WM_WAIT_BOOT_DONE, &status);
+#endif
+    if (_wifiman_autoConnect)
+        _wifiman_checkConnection();
+}
+
+bool wifiman_bootPending()
+{
+    return __atomic_load_n(&_wifiman_bootPending, __ATOMIC_ACQUIRE) != 0;
 }
+#endif
 
 void wifiman_stop()
 {
     WiFi.removeEvent(_wifiman_wifiConnectedEvent, ARDUINO_EVENT_WIFI_STA_CONNECTED);
     WiFi.removeEvent(_wifiman_wifiDisconnectedEvent, ARDUINO_EVENT_WIFI_STA_DISCONNECTED);
+    WiFi.removeEvent(_wifiman_wifiGotIPEvent, ARDUINO_EVENT_WIFI_STA_GOT_IP);
+#if WM_FEATURE_AUTOCONNECT
+    WiFi.removeEvent(_wifiman_wifiScanDoneEvent, ARDUINO_EVENT_WIFI_SCAN_DONE);
+#endif
 
-    if (_wifiman_autoConnect)
-    {
-        WiFi.removeEvent(_wifiman_wifiScanDoneEvent, ARDUINO_EVENT_WIFI_SCAN_DONE);
-        vTaskDelete(_wifiman_workerTaskHandle);
-        _wifiman_workerTaskHandle = nullptr;
-    }
+#if WM_FEATURE_WATCHDOG
+    esp_timer_stop(_wifiman_watchdogTimer);
+    esp_timer_delete(_wifiman_watchdogTimer);
+    _wifiman_watchdogTimer = nullptr;
+#endif
+
+#if WM_FEATURE_WORKER
+    vTaskDelete(_wifiman_workerTaskHandle);
+    _wifiman_workerTaskHandle = nullptr;
 
     vSemaphoreDelete(nextConnect.lock);
     vSemaphoreDelete(nextScan.lock);
+#endif
     _wifiman_data = nullptr;
-}
+    __atomic_store_n(&_wifiman_statusWord, 0x000000FF, __ATOMIC_RELEASE);
 
-void wifiman_setScanInterval(uint32_t newInterval)
-{
-    _wifiman_scanInterval = newInterval;
+    vSemaphoreDelete(_wifiman_scanLock);
+    _wifiman_scanLock = nullptr;
 }
 
-uint32_t wifiman_getScanInterval()
+IRAM_ATTR WM_Status wifiman_getStatusFromISR()
 {
-    return _wifiman_scanInterval;
+    _WM_StatusWord result;
+    result.word = __atomic_load_n(&_wifiman_statusWord, __ATOMIC_ACQUIRE);
+    return result.status;
 }
 
-void wifiman_setRetryCount(uint8_t count)
+void wifiman_scan()
 {
-    _wifiman_maxRetries = count;
+    assert(_wifiman_data != nullptr);
+
+    _wifiman_doScan(0);
 }
 
-uint8_t wifiman_getRetryCount()
+#if WM_FEATURE_WAITERS
+void wifiman_addWaiter(WM_Waiter *waiter)
 {
-    return _wifiman_maxRetries;
+    assert(waiter != nullptr && waiter->resume != nullptr);
+
+    portENTER_CRITICAL(&_wifiman_waiterMux);
+    waiter->next = _wifiman_waiters;
+    _wifiman_waiters = waiter;
+    portEXIT_CRITICAL(&_wifiman_waiterMux);
 }
 
-// NOTE (JSchaefer, 05.08.23): Try to minimize use of pref.isKey, since it is suuuper
-// wasteful and badly implemented.
-// we will just call the API functions with possibly invalid keys, which seems to be
-// fine. It generates an error log, but is handled internally and does not crash.
-uint8_t wifiman_readFromEEPROM(WM_SharedData *data, uint8_t startIndex, uint8_t count)
+bool wifiman_removeWaiter(WM_Waiter *waiter)
 {
-    if (data == nullptr)
-        return 0;
+    bool found = false;
 
-    Preferences pref;
-    pref.begin(WM_PREFERENCES_NAMESPACE, true);
+    portENTER_CRITICAL(&_wifiman_waiterMux);
+    for (WM_Waiter **link = &_wifiman_waiters; *link != nullptr; link = &(*link)->next)
+    {
+        if (*link != waiter)
+            continue;
 
-    char keySSID[16] = "";
-    char keyPass[16] = "";
-    char keyState[16] = "";
-    // TODO: Read ssid and pass directly to target char*
-    // TODO: Use char[] with fixed length instead of char* in WM_WifiNetwork ??
-    String valueSSID;
-    String valuePass;
+        *link = waiter->next;
+        found = true;
+        break;
+    }
+    portEXIT_CRITICAL(&_wifiman_waiterMux);
 
-    uint8_t entriesRead = 0;
+    return found;
+}
+
+static void _wifiman_fireWaiters(WM_WaitEvent event, const WM_Status *status)
+{
+    WM_Waiter *fired = nullptr;
 
-    for (int i = startIndex; i < startIndex + count && i < data->capacity; ++i)
+    // Unlink all finished waiters first, so resume can add or remove waiters
+    portENTER_CRITICAL(&_wifiman_waiterMux);
+    WM_Waiter **link = &_wifiman_waiters;
+    while (*link != nullptr)
     {
-        snprintf(keySSID, 16, WM_PREFERENCES_KEY_SSID, i);
-        
-        if (! pref.isKey(keySSID))
-            break;
+        WM_Waiter *waiter = *link;
 
-        if (i < data->length)
+        if (waiter->event == event && (waiter->ready == nullptr || waiter->ready(waiter->context, status)))
         {
-            free(data->networks[i]->ssid);
-            free(data->networks[i]->pass);
+            *link = waiter->next;
+            waiter->next = fired;
+            fired = waiter;
         }
         else
         {
-            data->networks[i] = (WM_WifiNetwork*)malloc(sizeof(WM_WifiNetwork));
-            ++(data->length);
+            link = &waiter->next;
         }
+    }
+    portEXIT_CRITICAL(&_wifiman_waiterMux);
 
-        valueSSID = pref.getString(keySSID, "");
-        data->networks[i]->ssid = strdup(valueSSID.c_str());
-
-        snprintf(keyPass, 16, WM_PREFERENCES_KEY_PASS, i);
-        valuePass = pref.getString(keyPass, "");
-        if (valuePass[0] != 0)
-            data->networks[i]->pass = strdup(valuePass.c_str());
-        else
-            data->networks[i]->pass = nullptr;
-
-        snprintf(keyState, 16, WM_PREFERENCES_KEY_STATE, i);
-        data->networks[i]->state = (WM_NetworkWorkingState)pref.getChar(keyState, 0);
-
-        ++entriesRead;
+    while (fired != nullptr)
+    {
+        // the waiter might be gone after resume
+        WM_Waiter *waiter = fired;
+        fired = waiter->next;
+        waiter->resume(waiter->context, status);
     }
+}
+#endif
 
-    pref.end();
+void wifiman_setScanInterval(uint32_t newInterval)
+{
+    _wifiman_scanInterval = newInterval;
+}
 
-    return entriesRead;
+uint32_t wifiman_getScanInterval()
+{
+    return _wifiman_scanInterval;
 }
 
-void wifiman_saveToEEPROM(WM_SharedData *data, uint8_t startIndex, uint8_t count)
+void wifiman_setScanMaxAge(uint32_t maxAge)
 {
-    if (data == nullptr || count == 0)
-        return;
+    _wifiman_scanMaxAge = maxAge;
+}
 
-    if (count == (uint8_t)-1)
-        count = data->capacity - startIndex;
+uint32_t wifiman_getScanMaxAge()
+{
+    return _wifiman_scanMaxAge;
+}
 
-    Preferences pref;
-    pref.begin(WM_PREFERENCES_NAMESPACE, false);
+void wifiman_setScanParameters(bool passive, uint16_t msPerChannel)
+{
+    _wifiman_scanPassive = passive;
+    _wifiman_scanMsPerChannel = msPerChannel;
+}
 
-    char keySSID[16] = "";
-    char keyPass[16] = "";
-    char keyState[16] = "";
+#if WM_FEATURE_FAST_SCAN
+void wifiman_setFastScan(bool enabled, int goodScore, bool finishLater)
+{
+    _wifiman_fastScan = enabled;
+    _wifiman_fastScanGoodScore = goodScore;
+    _wifiman_fastScanFinishLater = finishLater;
+}
 
-    for (int i = startIndex; i < startIndex + count && i < data->capacity; ++i)
-    {
-        snprintf(keySSID, 16, WM_PREFERENCES_KEY_SSID, i);
-        snprintf(keyPass, 16, WM_PREFERENCES_KEY_PASS, i);
-        snprintf(keyState, 16, WM_PREFERENCES_KEY_STATE, i);
+bool wifiman_getFastScan()
+{
+    return _wifiman_fastScan;
+}
+#endif
 
-        if (i < data->length)
+#if WM_FEATURE_POWER_SAVE
+void wifiman_setPowerSave(wifi_ps_type_t idleLevel)
+{
+    _wifiman_powerSaveIdle = idleLevel;
+    _wifiman_powerSaveManaged = true;
+    _wifiman_powerSaveCurrent = -1;
+    _wifiman_updatePowerSave();
+}
+
+wifi_ps_type_t wifiman_getPowerSave()
+{
+    return _wifiman_powerSaveIdle;
+}
+
+void wifiman_requestHighPerformance()
+{
+    __atomic_add_fetch(&_wifiman_highPerformanceRequests, 1, __ATOMIC_SEQ_CST);
+    _wifiman_updatePowerSave();
+}
+
+void wifiman_releaseHighPerformance()
+{
+    assert(_wifiman_highPerformanceRequests > 0);
+
+    __atomic_sub_fetch(&_wifiman_highPerformanceRequests, 1, __ATOMIC_SEQ_CST);
+    _wifiman_updatePowerSave();
+}
+
+static void _wifiman_setRadioFlag(uint8_t flag, bool set)
+{
+    if (set)
+        __atomic_or_fetch(&_wifiman_radioFlags, flag, __ATOMIC_SEQ_CST);
+    else
+        __atomic_and_fetch(&_wifiman_radioFlags, (uint8_t)~flag, __ATOMIC_SEQ_CST);
+
+    _wifiman_updatePowerSave();
+}
+
+// Called from the event task, the worker and the user, so keep it idempotent
+static void _wifiman_updatePowerSave()
+{
+    if (! _wifiman_powerSaveManaged)
+        return;
+
+    uint8_t flags = __atomic_load_n(&_wifiman_radioFlags, __ATOMIC_SEQ_CST);
+    uint8_t requests = __atomic_load_n(&_wifiman_highPerformanceRequests, __ATOMIC_SEQ_CST);
+
+    // Modem sleep slows down scans, association and DHCP, so it is only used
+    // while associated and nothing else is going on
+    wifi_ps_type_t level = (flags == WM_RADIO_ASSOCIATED && requests == 0 ? _wifiman_powerSaveIdle : WIFI_PS_NONE);
+
+    if ((int8_t)level == _wifiman_powerSaveCurrent)
+        return;
+
+    WM_LOG("[WIFIMAN] Power save: %d -> %d\n", _wifiman_powerSaveCurrent, level);
+    _wifiman_powerSaveCurrent = level;
+    WiFi.setSleep(level);
+}
+#endif
+
+void wifiman_setRetryCount(uint8_t count)
+{
+    _wifiman_maxRetries = count;
+}
+
+uint8_t wifiman_getRetryCount()
+{
+    return _wifiman_maxRetries;
+}
+
+void wifiman_setRetryBackoff(uint32_t baseMs, uint32_t maxMs)
+{
+    _wifiman_backoffBase = baseMs;
+    _wifiman_backoffMax = maxMs;
+}
+
+uint32_t wifiman_getRetryBackoffBase()
+{
+    return _wifiman_backoffBase;
+}
+
+uint32_t wifiman_getRetryBackoffMax()
+{
+    return _wifiman_backoffMax;
+}
+
+#if WM_FEATURE_UPLINK_PROBE
+void wifiman_setUplinkProbe(WM_UplinkProbeMode mode, const char *host, uint16_t port, const char *path, uint16_t timeoutMs)
+{
+    assert(mode == WM_PROBE_NONE || host != nullptr);
+
+    free(_wifiman_probeHost);
+    free(_wifiman_probePath);
+    _wifiman_probeHost = (host == nullptr ? nullptr : strdup(host));
+    _wifiman_probePath = (path == nullptr ? strdup("/") : strdup(path));
+    _wifiman_probePort = port;
+    _wifiman_probeTimeout = timeoutMs;
+    _wifiman_probeMode = mode;
+}
+
+WM_UplinkProbeMode wifiman_getUplinkProbe()
+{
+    return _wifiman_probeMode;
+}
+#endif
+
+#if WM_FEATURE_PERSISTENCE
+uint8_t wifiman_readFromEEPROM(WM_SharedData *data, uint8_t startIndex, uint8_t count)
+{
+    if (data == nullptr)
+        return 0;
+
+    uint32_t start = micros();
+
+    uint8_t entriesRead = WM_Policies::Storage::read(data, startIndex, count);
+
+    _wifiman_storageStats.lastReadUs = micros() - start;
+    ++_wifiman_storageStats.reads;
+
+    _wifiman_rebuildSets(data);
+    // entries before the factory networks end are not read by the policy
+    uint8_t first = (startIndex > WM_FACTORY_COUNT(data) ? startIndex : WM_FACTORY_COUNT(data));
+    for (int i = first; i < first + entriesRead; ++i)
+        _wifiman_setBit(&data->dirty, i, false);
+
+    return entriesRead;
+}
+
+void wifiman_saveToEEPROM(WM_SharedData *data, uint8_t startIndex, uint8_t count, bool onlyChanged)
+{
+    if (data == nullptr || count == 0)
+        return;
+
+    if (count == (uint8_t)-1)
+        count = data->capacity - startIndex;
+
+    uint32_t start = micros();
+
+    WM_Policies::Storage::save(data, startIndex, count, onlyChanged ? &data->dirty : nullptr);
+#if WM_FEATURE_FACTORY_TABLE
+    _wifiman_saveFactoryOverlay(data, onlyChanged);
+#endif
+
+    _wifiman_storageStats.lastSaveUs = micros() - start;
+    ++_wifiman_storageStats.saves;
+
+    for (int i = startIndex; i < startIndex + count && i < data->length; ++i)
+        _wifiman_setBit(&data->dirty, i, false);
+}
+
+const WM_StorageStats* wifiman_getStorageStats()
+{
+    return &_wifiman_storageStats;
+}
+
+uint32_t wifiman_estimateFlashLifetimeDays(uint32_t savesPerDay, uint8_t nvsPages)
+{
+    if (_wifiman_storageStats.saves == 0 || savesPerDay == 0)
+        return 0;
+    if (_wifiman_storageStats.entriesWritten == 0)
+        return -1;
+
+    uint64_t totalEntries = (uint64_t)nvsPages * WM_NVS_ENTRIES_PER_PAGE * WM_NVS_ERASE_CYCLES;
+    uint64_t entriesPerDay = (uint64_t)_wifiman_storageStats.entriesWritten * savesPerDay / _wifiman_storageStats.saves;
+
+    if (entriesPerDay == 0)
+        return -1;
+
+    uint64_t days = totalEntries / entriesPerDay;
+
+    return (days > UINT32_MAX - 1 ? UINT32_MAX - 1 : days);
+}
+
+// Count of 32 byte entries a string value occupies in NVS (1 header entry + data)
+static inline uint32_t _wifiman_nvsStringEntries(const char *value)
+{
+    return 1 + (strlen(value) + 1 + 31) / 32;
+}
+
+// NOTE (JSchaefer, 05.08.23): Try to minimize use of pref.isKey, since it is suuuper
+// wasteful and badly implemented.
+// we will just call the API functions with possibly invalid keys, which seems to be
+// fine. It generates an error log, but is handled internally and does not crash.
+// Reads key into buffer. A value that does not fit (i.e. saved before
+// wifiman_addOrUpdateNetwork checked lengths) is read into fallback instead of
+// getting lost. Returns the value, an empty string if key is missing.
+static const char* _wifiman_readString(Preferences &pref, const char *key, char *buffer, size_t size, String &fallback)
+{
+    buffer[0] = 0;
+    if (pref.getString(key, buffer, size) > 0 || ! pref.isKey(key))
+        return buffer;
+
+    fallback = pref.getString(key);
+    WM_LOG("[WIFIMAN] NVS value %s has %u bytes, more than %u\n", key, fallback.length(), (unsigned)(size - 1));
+    return fallback.c_str();
+}
+
+uint8_t WM_StoragePolicyNVS::read(WM_SharedData *data, uint8_t startIndex, uint8_t count)
+{
+    Preferences pref;
+    pref.begin(WM_PREFERENCES_NAMESPACE, true);
+
+    char keySSID[16] = "";
+    char keyPass[16] = "";
+    char keyState[16] = "";
+    // Read into stack buffers instead of Strings, so only the final strdup
+    // touches the heap
+    char valueSSID[WM_MAX_SSID_LENGTH + 1];
+    char valuePass[WM_MAX_PASS_LENGTH + 1];
+    // only used for values longer than that
+    String longSSID;
+    String longPass;
+
+    uint8_t entriesRead = 0;
+    // user networks are saved after the factory networks, starting at key 0
+    uint8_t first = WM_FACTORY_COUNT(data);
+
+    for (int i = (startIndex > first ? startIndex : first); i < startIndex + count && i < data->capacity; ++i)
+    {
+        snprintf(keySSID, 16, WM_PREFERENCES_KEY_SSID, i - first);
+        
+        if (! pref.isKey(keySSID))
+            break;
+
+        const char *ssid = _wifiman_readString(pref, keySSID, valueSSID, sizeof(valueSSID), longSSID);
+
+        snprintf(keyPass, 16, WM_PREFERENCES_KEY_PASS, i - first);
+        const char *pass = _wifiman_readString(pref, keyPass, valuePass, sizeof(valuePass), longPass);
+
+        if (i >= data->length)
+        {
+            data->networks[i] = _wifiman_allocNetwork();
+            ++(data->length);
+        }
+
+        // Keep existing allocations if the value did not change (i.e. on reload)
+        WM_WifiNetwork *network = data->networks[i];
+        if (network->ssid == nullptr || strcmp(network->ssid, ssid) != 0)
+        {
+            free(network->ssid);
+            network->ssid = strdup(ssid);
+        }
+        if (network->pass == nullptr ? pass[0] != 0 : strcmp(network->pass, pass) != 0)
+            _wifiman_setPass(data, network, pass[0] == 0 ? nullptr : pass);
+
+        snprintf(keyState, 16, WM_PREFERENCES_KEY_STATE, i - first);
+        data->networks[i]->state = (WM_NetworkWorkingState)pref.getChar(keyState, 0);
+
+        ++entriesRead;
+    }
+
+    pref.end();
+
+    return entriesRead;
+}
+
+void WM_StoragePolicyNVS::save(WM_SharedData *data, uint8_t startIndex, uint8_t count, const WM_NetworkSet *changed)
+{
+    Preferences pref;
+    pref.begin(WM_PREFERENCES_NAMESPACE, false);
+
+    char keySSID[16] = "";
+    char keyPass[16] = "";
+    char keyState[16] = "";
+    // factory networks are not saved here (see _wifiman_saveFactoryOverlay)
+    uint8_t first = WM_FACTORY_COUNT(data);
+
+    for (int i = (startIndex > first ? startIndex : first); i < startIndex + count && i < data->capacity; ++i)
+    {
+        snprintf(keySSID, 16, WM_PREFERENCES_KEY_SSID, i - first);
+        snprintf(keyPass, 16, WM_PREFERENCES_KEY_PASS, i - first);
+        snprintf(keyState, 16, WM_PREFERENCES_KEY_STATE, i - first);
+
+        if (i < data->length)
         {
+            if (changed != nullptr && ! _wifiman_testBit(changed, i))
+                continue;
+
             pref.putString(keySSID, data->networks[i]->ssid);
+            _wifiman_storageStats.entriesWritten += _wifiman_nvsStringEntries(data->networks[i]->ssid);
             if (data->networks[i]->pass != nullptr)
+            {
                 pref.putString(keyPass, data->networks[i]->pass);
+                _wifiman_storageStats.entriesWritten += _wifiman_nvsStringEntries(data->networks[i]->pass);
+            }
+            else
+            {
+                // do not keep the password of a previous network at this index
+                pref.remove(keyPass);
+                ++_wifiman_storageStats.keysRemoved;
+            }
             pref.putChar(keyState, data->networks[i]->state);
+            _wifiman_storageStats.entriesWritten += 1;
+            _wifiman_storageStats.keysWritten += (data->networks[i]->pass != nullptr ? 3 : 2);
         }
         else
         {
@@ -284,16 +1248,76 @@ void wifiman_saveToEEPROM(WM_SharedData *data, uint8_t startIndex, uint8_t count
             pref.remove(keySSID);
             pref.remove(keyPass);
             pref.remove(keyState);
+            _wifiman_storageStats.keysRemoved += 3;
         }
     }
 
     pref.end();
 }
 
+#if WM_FEATURE_FACTORY_TABLE
+// One byte per factory table entry, passwords changed by the user get their
+// own key. Factory networks are never rewritten, only their overlay.
+static void _wifiman_saveFactoryOverlay(WM_SharedData *data, bool onlyChanged)
+{
+    if (_wifiman_factoryTableSize == 0)
+        return;
+
+    bool changed = _wifiman_factoryOverlayDirty || ! onlyChanged;
+    for (int i = 0; i < data->factoryCount && ! changed; ++i)
+        changed = _wifiman_testBit(&data->dirty, i);
+
+    if (! changed)
+        return;
+
+    // entries missing in the list were deleted
+    uint8_t overlay[254];
+    memset(overlay, WM_FACTORY_OVERLAY_DELETED, _wifiman_factoryTableSize);
+
+    Preferences pref;
+    pref.begin(WM_PREFERENCES_NAMESPACE, false);
+
+    char keyPass[16] = "";
+
+    for (int i = 0; i < data->factoryCount; ++i)
+    {
+        WM_WifiNetwork *network = data->networks[i];
+        overlay[network->factoryIndex] = ((network->state + 1) & WM_FACTORY_OVERLAY_STATE);
+
+        if (network->constPass)
+            continue;
+
+        overlay[network->factoryIndex] |= WM_FACTORY_OVERLAY_PASS;
+
+        if (onlyChanged && ! _wifiman_testBit(&data->dirty, i))
+            continue;
+
+        snprintf(keyPass, 16, WM_PREFERENCES_KEY_FACTORY_PASS, network->factoryIndex);
+        pref.putString(keyPass, network->pass == nullptr ? "" : network->pass);
+        _wifiman_storageStats.entriesWritten += _wifiman_nvsStringEntries(network->pass == nullptr ? "" : network->pass);
+        ++_wifiman_storageStats.keysWritten;
+    }
+
+    pref.putBytes(WM_PREFERENCES_KEY_FACTORY_OVERLAY, overlay, _wifiman_factoryTableSize);
+    pref.putUInt(WM_PREFERENCES_KEY_FACTORY_SIGNATURE, _wifiman_factorySignature);
+    // blob header + data, signature
+    _wifiman_storageStats.entriesWritten += 2 + (_wifiman_factoryTableSize + 31) / 32 + 1;
+    _wifiman_storageStats.keysWritten += 2;
+
+    pref.end();
+
+    for (int i = 0; i < data->factoryCount; ++i)
+        _wifiman_setBit(&data->dirty, i, false);
+    _wifiman_factoryOverlayDirty = false;
+}
+#endif
+#endif
+
 uint8_t wifiman_addOrUpdateNetwork(WM_SharedData *data, const char *ssid, const char *pass, bool *existingUpdated)
 {
-    // TODO: Check length of ssid and pass? (look up what max for Wifi functions is and how wifi handles input that is too long)
-    if (data == nullptr || ssid == nullptr)
+    // WiFi.begin would reject longer values, and the NVS read expects them to fit
+    if (data == nullptr || ssid == nullptr || strlen(ssid) > WM_MAX_SSID_LENGTH
+        || (pass != nullptr && strlen(pass) > WM_MAX_PASS_LENGTH))
         return -1;
 
     for (int i = 0; i < data->length; ++i)
@@ -301,9 +1325,10 @@ uint8_t wifiman_addOrUpdateNetwork(WM_SharedData *data, const char *ssid, const
         if (strcmp(data->networks[i]->ssid, ssid) != 0)
             continue;
 
-        free(data->networks[i]->pass);
-        data->networks[i]->pass = (pass == nullptr ? nullptr : strdup(pass));
-        data->networks[i]->state = NETWORK_STATE_UNKNOWN;
+        _wifiman_setPass(data, data->networks[i], pass);
+        _wifiman_markDirty(data, i);
+        _wifiman_setState(data, i, NETWORK_STATE_UNKNOWN);
+        _wifiman_setUplink(data, i, UPLINK_STATE_UNKNOWN);
 
         if (existingUpdated != nullptr)
             *existingUpdated = true;
@@ -314,17 +1339,38 @@ uint8_t wifiman_addOrUpdateNetwork(WM_SharedData *data, const char *ssid, const
     if (data->length == data->capacity)
         return -1;
 
-    data->networks[data->length] = (WM_WifiNetwork*)malloc(sizeof(WM_WifiNetwork));
-    data->networks[data->length]->ssid = strdup(ssid);
-    data->networks[data->length]->pass = (pass == nullptr ? nullptr : strdup(pass));
-    data->networks[data->length]->state = NETWORK_STATE_UNKNOWN;
+    WM_WifiNetwork *network = _wifiman_allocNetwork();
+    network->ssid = strdup(ssid);
+    network->pass = _wifiman_internPass(data, pass);
 
     if (existingUpdated != nullptr)
         *existingUpdated = false;
 
-    ++(data->length);
+    // bits of the new index, the entry itself is not reachable yet
+    uint8_t index = data->length;
+    network->state = NETWORK_STATE_UNKNOWN;
+    _wifiman_setBit(&data->usable, index, true);
+    _wifiman_setBit(&data->failed, index, false);
+    _wifiman_markDirty(data, index);
+    _wifiman_setBit(&data->offline, index, false);
+    _wifiman_setBit(&data->inRange, index, false);
+    _wifiman_scanMapValid = false;
+
+#if WM_FEATURE_SORTED_INDEX
+    // lookups see the entry, its index position and the new length at once
+    portENTER_CRITICAL(&_wifiman_indexMux);
+    uint8_t position = _wifiman_searchSorted(data, ssid, 0, true);
+    memmove(data->sorted + position + 1, data->sorted + position, index - position);
+    data->sorted[position] = index;
+    data->networks[index] = network;
+    __atomic_store_n(&data->length, index + 1, __ATOMIC_RELEASE);
+    portEXIT_CRITICAL(&_wifiman_indexMux);
+#else
+    data->networks[index] = network;
+    __atomic_store_n(&data->length, index + 1, __ATOMIC_RELEASE);
+#endif
 
-    return (data->length - 1);
+    return index;
 }
 
 uint8_t wifiman_deleteNetworkByName(WM_SharedData *data, const char *ssid)
@@ -337,89 +1383,403 @@ uint8_t wifiman_deleteNetwork(WM_SharedData *data, uint8_t index)
     if (data == nullptr || index >= data->length || data->networks[index] == nullptr)
         return -1;
 
-    free(data->networks[index]->ssid);
-    free(data->networks[index]->pass);
-    free(data->networks[index]);
+    // Factory networks are saved by table index and user networks by their
+    // position after the factory networks, so no saved index changes
+#if WM_FEATURE_FACTORY_TABLE
+    bool keepSavedIndices = (index < data->factoryCount);
+    if (keepSavedIndices)
+    {
+        --(data->factoryCount);
+        _wifiman_factoryOverlayDirty = true;
+    }
+#elif WM_FEATURE_PERSISTENCE
+    bool keepSavedIndices = false;
+#endif
+
+    WM_WifiNetwork *removed = data->networks[index];
+    uint8_t length = data->length - 1;
+
+#if WM_FEATURE_SORTED_INDEX
+    // drop the entry and close the gap in the network indices, lookups see
+    // the index, the list and the new length change at once
+    portENTER_CRITICAL(&_wifiman_indexMux);
+    for (int i = 0, j = 0; i < data->length; ++i)
+    {
+        if (data->sorted[i] == index)
+            continue;
+
+        data->sorted[j++] = data->sorted[i] - (data->sorted[i] > index ? 1 : 0);
+    }
+#endif
+    memmove(data->networks + index, data->networks + index + 1, sizeof(data->networks[0]) * (length - index));
+    data->networks[length] = nullptr;
+    __atomic_store_n(&data->length, length, __ATOMIC_RELEASE);
+#if WM_FEATURE_SORTED_INDEX
+    portEXIT_CRITICAL(&_wifiman_indexMux);
+#endif
+
+    // no lookup can reach it anymore
+    _wifiman_freeNetwork(removed);
+
+    _wifiman_removeBit(&data->usable, index);
+    _wifiman_removeBit(&data->failed, index);
+    _wifiman_removeBit(&data->offline, index);
+    _wifiman_removeBit(&data->inRange, index);
+#if WM_FEATURE_FAST_SCAN
+    // sweep candidates are scored again by wifiman_connectToBestWifi
+    _wifiman_removeBit(&_wifiman_sweepInRange, index);
+    memmove(_wifiman_sweepRSSI + index, _wifiman_sweepRSSI + index + 1, data->length - index);
+    if (_wifiman_sweepBestIndex == index)
+        _wifiman_sweepBestIndex = -1;
+    else if (_wifiman_sweepBestIndex > index && _wifiman_sweepBestIndex != (uint8_t)-1)
+        --_wifiman_sweepBestIndex;
+#endif
 
-    memmove(data->networks + index, data->networks + index + 1, sizeof(data->networks[0]) * (data->length - index - 1));
+#if WM_FEATURE_PERSISTENCE
+    // all following networks moved to a new index
+    _wifiman_removeBit(&data->dirty, index);
+    for (int i = index; i < data->length && ! keepSavedIndices; ++i)
+        _wifiman_markDirty(data, i);
+#endif
 
-    data->networks[--(data->length)] = nullptr;
+    // keep indices of the current scan valid
+    WM_SCAN_LOCK();
+    for (int i = 0; i < _wifiman_scanMapLength; ++i)
+    {
+        if (_wifiman_scanMap[i] == index)
+            _wifiman_scanMap[i] = -1;
+        else if (_wifiman_scanMap[i] > index && _wifiman_scanMap[i] != (uint8_t)-1)
+            --(_wifiman_scanMap[i]);
+    }
+    for (int g = 0; g < _wifiman_scanGroupCount; ++g)
+    {
+        if (_wifiman_scanGroups[g].networkIndex == index)
+            _wifiman_scanGroups[g].networkIndex = -1;
+        else if (_wifiman_scanGroups[g].networkIndex > index && _wifiman_scanGroups[g].networkIndex != (uint8_t)-1)
+            --(_wifiman_scanGroups[g].networkIndex);
+    }
 
     if (data->status.targetNetwork == index)
+    {
         data->status.targetNetwork = -1;
+        _wifiman_publishStatus(data);
+    }
     else if (data->status.targetNetwork > index && data->status.targetNetwork != (uint8_t)-1)
+    {
         --(data->status.targetNetwork);
+        _wifiman_publishStatus(data);
+    }
 
     return index;
 }
 
-uint8_t wifiman_findNetworkInList(WM_SharedData *data, const char *ssid)
+#if WM_FEATURE_FACTORY_TABLE
+uint8_t wifiman_loadFactoryNetworks(WM_SharedData *data, const WM_FactoryNetwork *table, uint8_t count, uint32_t signature)
 {
-    if (data == nullptr || ssid == nullptr || ssid[0] == 0)
-        return -1;
-
-    for (int i = 0; i < data->length; ++i)
-    {
-        if (strcmp(data->networks[i]->ssid, ssid) != 0)
-            continue;
+    if (data == nullptr || table == nullptr)
+        return 0;
 
-        return i;
-    }
+    return _wifiman_loadConstNetworks(data, table, count, signature, &_wifiman_factoryEntry);
+}
 
-    return -1;
+static void _wifiman_factoryEntry(const void *table, uint8_t index, const char **ssid, const char **pass)
+{
+    *ssid = ((const WM_FactoryNetwork*)table)[index].ssid;
+    *pass = ((const WM_FactoryNetwork*)table)[index].pass;
 }
 
-uint8_t wifiman_findNetworkInList(WM_SharedData *data, const uint8_t *ssid, const uint8_t ssidLen)
+// Strings of the table have to stay valid as long as data exists
+static uint8_t _wifiman_loadConstNetworks(WM_SharedData *data, const void *table, uint8_t count, uint32_t signature,
+        void (*entry)(const void *table, uint8_t index, const char **ssid, const char **pass))
 {
-    if (data == nullptr || ssid == nullptr || ssidLen == 0 || ssid[0] == 0)
-        return -1;
+    assert(data->length == 0);
 
-    for (int i = 0; i < data->length; ++i)
+    if (count > data->capacity)
+        count = data->capacity;
+
+    _wifiman_factoryTableSize = count;
+    _wifiman_factorySignature = signature;
+    _wifiman_factoryOverlayDirty = false;
+
+    // No overlay (first boot or new table): all entries present, state unknown
+    uint8_t overlay[254] = {};
+#if WM_FEATURE_PERSISTENCE
+    Preferences pref;
+    pref.begin(WM_PREFERENCES_NAMESPACE, true);
+
+    if (pref.getUInt(WM_PREFERENCES_KEY_FACTORY_SIGNATURE, 0) == signature)
     {
-        if (ssidLen != strlen(data->networks[i]->ssid))
-            continue;
-        if (memcmp(data->networks[i]->ssid, ssid, ssidLen) != 0)
+        pref.getBytes(WM_PREFERENCES_KEY_FACTORY_OVERLAY, overlay, count);
+    }
+    else
+    {
+        WM_LOG("[WIFIMAN] Factory table changed, overlay discarded\n");
+    }
+#endif
+
+    for (int i = 0; i < count; ++i)
+    {
+        const char *ssid;
+        const char *pass;
+        entry(table, i, &ssid, &pass);
+
+        if ((overlay[i] & WM_FACTORY_OVERLAY_DELETED) || ssid == nullptr)
             continue;
 
-        return i;
+        WM_WifiNetwork *network = _wifiman_allocNetwork();
+        network->ssid = (char*)ssid;
+        network->pass = (char*)pass;
+        network->factoryIndex = i;
+        network->constPass = true;
+
+#if WM_FEATURE_PERSISTENCE
+        if (overlay[i] & WM_FACTORY_OVERLAY_PASS)
+        {
+            char keyPass[16] = "";
+            char valuePass[WM_MAX_PASS_LENGTH + 1];
+            String longPass;
+            snprintf(keyPass, 16, WM_PREFERENCES_KEY_FACTORY_PASS, i);
+            const char *pass = _wifiman_readString(pref, keyPass, valuePass, sizeof(valuePass), longPass);
+
+            network->pass = (pass[0] == 0 ? nullptr : _wifiman_internPass(data, pass));
+            network->constPass = false;
+        }
+#endif
+
+        data->networks[data->length] = network;
+        _wifiman_setState(data, data->length, (WM_NetworkWorkingState)((overlay[i] & WM_FACTORY_OVERLAY_STATE) - 1));
+        ++(data->length);
     }
 
-    return -1;
+#if WM_FEATURE_PERSISTENCE
+    pref.end();
+    memset(&data->dirty, 0, sizeof(data->dirty));
+#endif
+
+    data->factoryCount = data->length;
+    _wifiman_scanMapValid = false;
+#if WM_FEATURE_SORTED_INDEX
+    _wifiman_rebuildIndex(data);
+#endif
+
+    WM_LOG("[WIFIMAN] %d factory networks loaded\n", data->factoryCount);
+
+    return data->factoryCount;
 }
+#endif
 
-uint8_t wifiman_countUsableNetworks(WM_SharedData *data)
+#if WM_FEATURE_PARTITION_TABLE
+uint8_t wifiman_loadPartitionNetworks(WM_SharedData *data, const char *label)
 {
-    if (data == nullptr)
+    if (data == nullptr || _wifiman_partitionMap != nullptr)
         return 0;
 
-    if (data->length == 0)
+    const esp_partition_t *partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, label);
+    if (partition == nullptr)
+    {
+        WM_LOG("[WIFIMAN] Partition %s not found\n", label);
         return 0;
+    }
 
-    uint8_t count = 0;
+    WM_PartitionHeader header;
+    if (esp_partition_read(partition, 0, &header, sizeof(header)) != ESP_OK ||
+            header.magic != WM_PARTITION_MAGIC || header.version != WM_PARTITION_VERSION ||
+            header.recordSize != sizeof(WM_PartitionRecord) || header.count > 254 ||
+            sizeof(header) + (size_t)header.count * sizeof(WM_PartitionRecord) > partition->size)
+    {
+        WM_LOG("[WIFIMAN] Partition %s has no valid network table\n", label);
+        return 0;
+    }
+
+    // Mapped for the lifetime of the program, the list points into it
+    const void *mapped = nullptr;
+    spi_flash_mmap_handle_t handle;
+    if (esp_partition_mmap(partition, 0, sizeof(header) + (size_t)header.count * sizeof(WM_PartitionRecord),
+            SPI_FLASH_MMAP_DATA, &mapped, &handle) != ESP_OK)
+    {
+        WM_LOG("[WIFIMAN] Partition %s could not be mapped\n", label);
+        return 0;
+    }
+
+    _wifiman_partitionMap = (const WM_PartitionRecord*)((const uint8_t*)mapped + sizeof(header));
+
+    return _wifiman_loadConstNetworks(data, _wifiman_partitionMap, header.count, header.signature, &_wifiman_partitionEntry);
+}
+
+static void _wifiman_partitionEntry(const void *table, uint8_t index, const char **ssid, const char **pass)
+{
+    const WM_PartitionRecord *record = ((const WM_PartitionRecord*)table) + index;
+
+    // Skip records which are not terminated, strings are used in place
+    bool valid = (record->ssid[0] != 0 && record->ssid[sizeof(record->ssid) - 1] == 0 &&
+            record->pass[sizeof(record->pass) - 1] == 0);
+
+    *ssid = (valid ? record->ssid : nullptr);
+    *pass = (valid && record->pass[0] != 0 ? record->pass : nullptr);
+}
+#endif
+
+// SSID of a scan result, WiFi.SSID(i) would allocate a String for each call
+static inline const char* _wifiman_scanSSID(int scanIndex)
+{
+    wifi_ap_record_t *record = (wifi_ap_record_t*)WiFi.getScanInfoByIndex(scanIndex);
+    return (record == nullptr ? "" : (const char*)record->ssid);
+}
+
+uint8_t wifiman_findNetworkInList(WM_SharedData *data, const char *ssid)
+{
+    if (data == nullptr || ssid == nullptr || ssid[0] == 0)
+        return -1;
+
+#if WM_FEATURE_SORTED_INDEX
+    uint8_t result = -1;
+
+    // SSIDs differing in case only are next to each other
+    portENTER_CRITICAL(&_wifiman_indexMux);
+    for (int i = _wifiman_searchSorted(data, ssid, 0, false); i < data->length; ++i)
+    {
+        WM_WifiNetwork *network = data->networks[data->sorted[i]];
+        if (strcasecmp(network->ssid, ssid) != 0)
+            break;
+        if (strcmp(network->ssid, ssid) == 0)
+        {
+            result = data->sorted[i];
+            break;
+        }
+    }
+    portEXIT_CRITICAL(&_wifiman_indexMux);
+
+    return result;
+#else
+    for (int i = 0; i < data->length; ++i)
+    {
+        if (strcmp(data->networks[i]->ssid, ssid) != 0)
+            continue;
+
+        return i;
+    }
+#endif
+
+    return -1;
+}
+
+uint8_t wifiman_findNetworkInList(WM_SharedData *data, const uint8_t *ssid, const uint8_t ssidLen)
+{
+    if (data == nullptr || ssid == nullptr || ssidLen == 0 || ssid[0] == 0)
+        return -1;
+
+#if WM_FEATURE_SORTED_INDEX
+    char terminated[33];
+    if (ssidLen >= sizeof(terminated))
+        return -1;
 
+    memcpy(terminated, ssid, ssidLen);
+    terminated[ssidLen] = 0;
+
+    // an embedded 0 cannot match a saved SSID of this length
+    if (strlen(terminated) != ssidLen)
+        return -1;
+
+    return wifiman_findNetworkInList(data, terminated);
+#else
     for (int i = 0; i < data->length; ++i)
     {
-        if (data->networks[i]->state != 0)
-            ++count;
+        if (ssidLen != strlen(data->networks[i]->ssid))
+            continue;
+        if (memcmp(data->networks[i]->ssid, ssid, ssidLen) != 0)
+            continue;
+
+        return i;
+    }
+
+    return -1;
+#endif
+}
+
+#if WM_FEATURE_SORTED_INDEX
+uint8_t wifiman_findNetworksByPrefix(WM_SharedData *data, const char *prefix, uint8_t *first)
+{
+    if (data == nullptr || first == nullptr)
+        return 0;
+
+    if (prefix == nullptr || prefix[0] == 0)
+    {
+        *first = 0;
+        return data->length;
     }
 
+    size_t prefixLength = strlen(prefix);
+    portENTER_CRITICAL(&_wifiman_indexMux);
+    *first = _wifiman_searchSorted(data, prefix, prefixLength, false);
+    uint8_t end = _wifiman_searchSorted(data, prefix, prefixLength, true);
+    portEXIT_CRITICAL(&_wifiman_indexMux);
+
+    return end - *first;
+}
+
+uint8_t wifiman_findNetworksInRange(WM_SharedData *data, const char *from, const char *to, uint8_t *first)
+{
+    if (data == nullptr || first == nullptr)
+        return 0;
+
+    portENTER_CRITICAL(&_wifiman_indexMux);
+    *first = (from == nullptr ? 0 : _wifiman_searchSorted(data, from, 0, false));
+    uint8_t end = (to == nullptr ? data->length : _wifiman_searchSorted(data, to, 0, false));
+    portEXIT_CRITICAL(&_wifiman_indexMux);
+
+    return (end > *first ? end - *first : 0);
+}
+#endif
+
+uint8_t wifiman_countUsableNetworks(WM_SharedData *data)
+{
+    if (data == nullptr)
+        return 0;
+
+    uint8_t count = 0;
+
+    for (int i = 0; i < 8; ++i)
+        count += __builtin_popcount(data->usable.bits[i]);
+
     return count;
 }
 
+bool wifiman_anyUsableInRange(WM_SharedData *data)
+{
+    if (data == nullptr)
+        return false;
+
+    for (int i = 0; i < 8; ++i)
+    {
+        if (data->usable.bits[i] & data->inRange.bits[i])
+            return true;
+    }
+
+    return false;
+}
+
+void wifiman_setNetworkState(WM_SharedData *data, uint8_t index, WM_NetworkWorkingState state)
+{
+    if (data == nullptr || index >= data->length)
+        return;
+
+    _wifiman_setState(data, index, state);
+}
+
 WM_ReturnCode wifiman_connectToNetwork(WM_SharedData *data, uint8_t index)
 {
     assert(data != nullptr);
     assert(index < data->length);
 
-    Serial.printf("[WIFIMAN] Manual connection to \"%s\"\n", data->networks[index]->ssid);
+    WM_LOG("[WIFIMAN] Manual connection to \"%s\"\n", data->networks[index]->ssid);
     _wifiman_connect(index, true, 0);
+    _wifiman_connectRequestTime = millis();
 
     _wifiman_retryCount = 0;
 
     data->status.code = CONNECTING;
     data->status.targetNetwork = index;
-    if (_wifiman_statusCallback != nullptr)
-        _wifiman_statusCallback(&data->status);
+    _wifiman_notifyStatus(data);
 
     return WMRT_SUCCESS;
 }
@@ -431,12 +1791,15 @@ WM_ReturnCode wifiman_connectToBestWifi(WM_SharedData *data)
     if (data->length == 0)
         return WMRT_NETWORK_NOT_IN_LIST;
 
-    Serial.print("[WIFIMAN] Connecting to best wifi...\n");
+    WM_LOG("[WIFIMAN] Connecting to best wifi...\n");
 
-    if (millis() - _wifiman_scanTime > WM_SCAN_MAX_AGE_MS)
+    if (millis() - _wifiman_scanTime > _wifiman_scanMaxAge)
     {
-        Serial.print("[WIFIMAN] Results are old, issuing new scan...\n");
+        WM_LOG("[WIFIMAN] Results are old, issuing new scan...\n");
 
+#if WM_FEATURE_FAST_SCAN
+        _wifiman_sweepRequested = _wifiman_fastScan;
+#endif
         _wifiman_doScan(0);
         _wifiman_scanTime = millis();
 
@@ -448,27 +1811,82 @@ WM_ReturnCode wifiman_connectToBestWifi(WM_SharedData *data)
     switch (scanResult)
     {
         case -2: // NOT STARTED 
+#if WM_FEATURE_FAST_SCAN
+            _wifiman_sweepRequested = _wifiman_fastScan;
+#endif
             _wifiman_doScan(0);
             return WMRT_SCAN_NOT_READY;
         case -1:  // RUNNING
             return WMRT_SCAN_NOT_READY;
         case 0:
+#if WM_FEATURE_FAST_SCAN
+            // empty last channel, the sweep result is still valid
+            if (_wifiman_sweepGeneration == _wifiman_scanGeneration && _wifiman_sweepGeneration != 0)
+                break;
+#endif
             return WMRT_NETWORK_NOT_IN_LIST;
     }
 
-    int bestRSSI = INT_MIN;
+    // When we are already connected (but the uplink probe failed) only switch
+    // to networks which are not known to be offline
+    bool connected = (WiFi.status() == WL_CONNECTED);
+    int bestScore = INT_MIN;
     int bestIndex = -1;
 
-    for (int i = 0; i < scanResult; ++i)
+    // Nothing to iterate, if the scan contains no usable network. With the
+    // map only the strongest access point per SSID has to be scored.
+    WM_SCAN_LOCK();
+    bool mapped = _wifiman_updateScanMap(data);
+    int candidates = (mapped ? (wifiman_anyUsableInRange(data) ? _wifiman_scanGroupCount : 0) : scanResult);
+
+#if WM_FEATURE_FAST_SCAN
+    // Scan results only hold the last channel of a sweep, so score all
+    // networks the sweep saw (the best one might have failed meanwhile)
+    if (_wifiman_sweepGeneration == _wifiman_scanGeneration && _wifiman_sweepGeneration != 0)
+    {
+        candidates = 0;
+        for (int i = 0; i < data->length; ++i)
+        {
+            if (! _wifiman_testBit(&_wifiman_sweepInRange, i) || ! _wifiman_testBit(&data->usable, i))
+                continue;
+
+            int score = WM_Policies::Scoring::score(data->networks[i], _wifiman_sweepRSSI[i], connected);
+            if (score != WM_SCORE_SKIP && score > bestScore)
+            {
+                bestScore = score;
+                bestIndex = i;
+            }
+        }
+
+        // The skipped channels might have other networks, scan them before
+        // giving up on the failed ones
+        if (bestIndex == -1 && _wifiman_sweepPartial)
+        {
+            WM_LOG("[WIFIMAN] No usable network in partial sweep, issuing full scan...\n");
+
+            _wifiman_sweepGeneration = 0;
+            _wifiman_sweepRequested = false;
+            _wifiman_doScan(0);
+            _wifiman_scanTime = millis();
+
+            return WMRT_SCAN_NOT_READY;
+        }
+    }
+#endif
+
+    for (int i = 0; i < candidates; ++i)
     {
-        uint8_t result = wifiman_findNetworkInList(data, WiFi.SSID(i).c_str());
+        uint8_t result = (mapped ? _wifiman_scanGroups[i].networkIndex : wifiman_findNetworkInList(data, _wifiman_scanSSID(i)));
+        int scanIndex = (mapped ? _wifiman_scanGroups[i].scanIndex : i);
 
-        if (result >= data->length || data->networks[result]->state == NETWORK_FAILED_BEFORE)
+        if (result >= data->length || ! _wifiman_testBit(&data->usable, result))
             continue;
+
+        int score = WM_Policies::Scoring::score(data->networks[result], WiFi.RSSI(scanIndex), connected);
         
-        if (WiFi.RSSI(i) > bestRSSI)
+        if (score != WM_SCORE_SKIP && score > bestScore)
         {
-            bestRSSI = WiFi.RSSI(i);
+            bestScore = score;
             bestIndex = result;
         }
     }
@@ -476,285 +1894,2042 @@ WM_ReturnCode wifiman_connectToBestWifi(WM_SharedData *data)
     if (bestIndex == -1)
     {
         //// EXPERIMENTAL reset all bad networks -> will retry after next scan interval
-        for (int i = 0; i < data->length; ++i)
+        for (int w = 0; w < 8; ++w)
         {
-            if (data->networks[i]->state == NETWORK_FAILED_BEFORE)
-                data->networks[i]->state = NETWORK_STATE_UNKNOWN;
+            while (data->failed.bits[w] != 0)
+                _wifiman_setState(data, w * 32 + __builtin_ctz(data->failed.bits[w]), NETWORK_STATE_UNKNOWN);
         }
         //// EXPERIMENTAL
         return WMRT_NETWORK_NOT_IN_LIST;
     }
 
-    Serial.printf("[WIFIMAN] Connecting to \"%s\"\n", data->networks[bestIndex]->ssid);
-    _wifiman_connect(bestIndex, true, 0);
+    WM_LOG("[WIFIMAN] Connecting to \"%s\"\n", data->networks[bestIndex]->ssid);
+    _wifiman_connect(bestIndex, true, 0);
+    _wifiman_connectRequestTime = millis();
+
+    _wifiman_retryCount = 0;
+
+    data->status.code = CONNECTING;
+    data->status.targetNetwork = bestIndex;
+    _wifiman_notifyStatus(data);
+
+    return WMRT_SUCCESS;
+}
+
+#if WM_FEATURE_DIAGNOSTICS
+void wifiman_print(WM_SharedData *data, HardwareSerial *output)
+{
+    if (data == nullptr)
+    {
+        output->print("wifiman_print: data ptr is NULL!\n");
+        return;
+    }
+
+    output->printf("--- WM_SharedData @ %p ---\n", data);
+    output->printf("Network list: %d of %d set @ %p\n", data->length, data->capacity, data->networks);
+    output->print("[#] SSID --- Password --- State --- Uplink (RTT)\n");
+    for (int i = 0; i < data->length; ++i)
+    {
+        output->printf("[%d] %s --- %s --- %d --- %d (%dms) @ %p\n", 
+                i, 
+                data->networks[i]->ssid, 
+                data->networks[i]->pass == nullptr ? "[none]" : data->networks[i]->pass, 
+                data->networks[i]->state, 
+                data->networks[i]->uplink,
+                data->networks[i]->uplinkRTT,
+                data->networks[i]);
+    }
+    output->printf("[%d] %p\n", data->length, data->networks[data->length]);
+}
+
+const WM_RadioStats* wifiman_getRadioStats()
+{
+    return &_wifiman_radioStats;
+}
+#endif
+
+#if WM_FEATURE_ENERGY
+void wifiman_setPowerModel(const WM_PowerModel *model)
+{
+    assert(model != nullptr);
+
+    _wifiman_powerModel = *model;
+}
+
+const WM_PowerModel* wifiman_getPowerModel()
+{
+    return &_wifiman_powerModel;
+}
+
+WM_EnergyStats wifiman_getEnergyStats()
+{
+    WM_EnergyStats result = _wifiman_energyStats;
+    ArduinoTime_t now = millis();
+
+    for (int i = 0; i < WM_ACTIVITY_COUNT; ++i)
+    {
+        if (_wifiman_activityStart[i] == 0)
+            continue;
+
+        uint32_t duration = now - _wifiman_activityStart[i];
+        result.radioMs[i] += duration;
+        result.energyUJ[i] += (uint64_t)duration * _wifiman_powerModel.mW[i];
+    }
+
+    return result;
+}
+
+void wifiman_setScanEnergyBudget(uint32_t millijoules, uint32_t periodMs)
+{
+    _wifiman_scanBudgetUJ = (uint64_t)millijoules * 1000;
+    _wifiman_scanBudgetPeriod = periodMs;
+    _wifiman_scanBudgetStart = millis();
+    _wifiman_scanBudgetSpentUJ = 0;
+}
+
+uint32_t wifiman_getScanEnergyRemaining()
+{
+    if (_wifiman_scanBudgetUJ == 0)
+        return -1;
+
+    _wifiman_scanBudgetExhausted(); // start a new period if necessary
+
+    if (_wifiman_scanBudgetSpentUJ >= _wifiman_scanBudgetUJ)
+        return 0;
+
+    return (_wifiman_scanBudgetUJ - _wifiman_scanBudgetSpentUJ) / 1000;
+}
+
+static void _wifiman_beginActivity(WM_Activity activity)
+{
+    _wifiman_endActivity(activity);
+
+    _wifiman_activityStart[activity] = millis();
+    ++_wifiman_energyStats.count[activity];
+}
+
+static void _wifiman_endActivity(WM_Activity activity)
+{
+    if (_wifiman_activityStart[activity] == 0)
+        return;
+
+    uint32_t duration = millis() - _wifiman_activityStart[activity];
+    uint64_t energy = (uint64_t)duration * _wifiman_powerModel.mW[activity];
+    _wifiman_activityStart[activity] = 0;
+
+    _wifiman_energyStats.radioMs[activity] += duration;
+    _wifiman_energyStats.energyUJ[activity] += energy;
+
+    if (activity == WM_ACTIVITY_SCAN_ACTIVE || activity == WM_ACTIVITY_SCAN_PASSIVE)
+        _wifiman_scanBudgetSpentUJ += energy;
+}
+
+static bool _wifiman_scanBudgetExhausted()
+{
+    if (_wifiman_scanBudgetUJ == 0)
+        return false;
+
+    if (millis() - _wifiman_scanBudgetStart >= _wifiman_scanBudgetPeriod)
+    {
+        _wifiman_scanBudgetStart = millis();
+        _wifiman_scanBudgetSpentUJ = 0;
+    }
+
+    return _wifiman_scanBudgetSpentUJ >= _wifiman_scanBudgetUJ;
+}
+#endif
+
+void wifiman_lockScanResults()
+{
+    if (_wifiman_scanLock != nullptr)
+        xSemaphoreTakeRecursive(_wifiman_scanLock, portMAX_DELAY);
+}
+
+void wifiman_unlockScanResults()
+{
+    if (_wifiman_scanLock != nullptr)
+        xSemaphoreGiveRecursive(_wifiman_scanLock);
+}
+
+uint8_t wifiman_getScanGroups(const WM_ScanGroup **groups)
+{
+    if (groups == nullptr || ! _wifiman_updateScanMap(_wifiman_data))
+        return 0;
+
+    *groups = _wifiman_scanGroups;
+    return _wifiman_scanGroupCount;
+}
+
+#if WM_FEATURE_DISPLAY_FILTER
+WM_ReturnCode wifiman_getDisplayFilterByScan(WM_WifiNetworkDisplay networks[], uint8_t count)
+{
+    assert(networks != nullptr);
+
+    if (count == 0)
+        return WMRT_SUCCESS;
+
+    auto scanResult = WiFi.scanComplete();
+
+    switch (scanResult)
+    {
+        case -2: // NOT STARTED 
+        case -1: // RUNNING
+            return WMRT_SCAN_NOT_READY;
+        case 0: // NO NETWORK IN RANGE
+            return WMRT_NETWORK_NOT_IN_LIST;
+    }
+
+    if (count < scanResult)
+        return WMRT_SIZE_MISMATCH;
+
+    for (int i = 0; i < scanResult; ++i)
+    {
+        networks[i].scanIndex = i;
+        networks[i].networkIndex = wifiman_findNetworkInList(_wifiman_data, _wifiman_scanSSID(i));
+    }
+
+    return WMRT_SUCCESS;
+}
+
+// Several access points with the same SSID: keep the strongest
+static void _wifiman_keepStrongest(WM_WifiNetworkDisplay *network, uint8_t scanIndex)
+{
+    if (network->scanIndex == (uint8_t)-1 || WiFi.RSSI(scanIndex) > WiFi.RSSI(network->scanIndex))
+        network->scanIndex = scanIndex;
+}
+
+WM_ReturnCode wifiman_getDisplayFilterBySaved(WM_WifiNetworkDisplay networks[], uint8_t count,
+        WM_WifiNetworkDisplay scanFilter[], uint8_t scanCount)
+{
+    assert(networks != nullptr);
+
+    if (count == 0)
+        return WMRT_SUCCESS;
+    if (count < _wifiman_data->length)
+        return WMRT_SIZE_MISMATCH;
+
+    for (int i = 0; i < _wifiman_data->length; ++i)
+    {
+        networks[i].networkIndex = i;
+        networks[i].scanIndex = -1;
+    }
+
+    auto scanResult = WiFi.scanComplete();
+
+    if (scanFilter == nullptr && scanResult <= 0)
+        return WMRT_SUCCESS;
+
+    WM_SCAN_LOCK();
+    if (scanFilter != nullptr)
+    {
+        for (int i = 0; i < scanCount; ++i)
+        {
+            if (scanFilter[i].networkIndex < count)
+                _wifiman_keepStrongest(&networks[scanFilter[i].networkIndex], scanFilter[i].scanIndex);
+        }
+    }
+    else if (_wifiman_updateScanMap(_wifiman_data))
+    {
+        for (int g = 0; g < _wifiman_scanGroupCount; ++g)
+        {
+            if (_wifiman_scanGroups[g].networkIndex < count)
+                networks[_wifiman_scanGroups[g].networkIndex].scanIndex = _wifiman_scanGroups[g].scanIndex;
+        }
+    }
+    else
+    {
+        for (int i = 0; i < scanResult; ++i)
+        {
+            uint8_t found = wifiman_findNetworkInList(_wifiman_data, _wifiman_scanSSID(i));
+            if (found < count)
+                _wifiman_keepStrongest(&networks[found], i);
+        }
+    }
+
+    return WMRT_SUCCESS;
+}
+
+static bool _wifiman_filterMatches(const WM_ScanFilter *filter, const WM_ScanEntry *entry)
+{
+    if (filter == nullptr)
+        return true;
+    if (filter->knownOnly && entry->networkIndex == (uint8_t)-1)
+        return false;
+    if (filter->minRSSI == INT8_MIN && filter->authModes == 0)
+        return true;
+    if (entry->record == nullptr || entry->record->rssi < filter->minRSSI)
+        return false;
+
+    return filter->authModes == 0 || (filter->authModes & (1ul << entry->record->authmode)) != 0;
+}
+
+WM_ReturnCode wifiman_visitScan(const WM_ScanFilter *filter, WM_ScanVisitor visitor, void *context)
+{
+    assert(visitor != nullptr);
+
+    auto scanResult = WiFi.scanComplete();
+
+    if (scanResult < 0)
+        return WMRT_SCAN_NOT_READY;
+    if (scanResult > UINT8_MAX)
+        scanResult = UINT8_MAX;
+
+    WM_SCAN_LOCK();
+    bool mapped = _wifiman_updateScanMap(_wifiman_data);
+    bool grouped = (mapped && filter != nullptr && filter->uniqueSSID);
+    int count = (grouped ? _wifiman_scanGroupCount : scanResult);
+
+    for (int i = 0; i < count; ++i)
+    {
+        uint8_t scanIndex = (grouped ? _wifiman_scanGroups[i].scanIndex : i);
+
+        WM_ScanEntry entry;
+        entry.scanIndex = scanIndex;
+        entry.record = (const wifi_ap_record_t*)WiFi.getScanInfoByIndex(scanIndex);
+        entry.networkIndex = (mapped ? _wifiman_scanMap[scanIndex] : wifiman_findNetworkInList(_wifiman_data, _wifiman_scanSSID(scanIndex)));
+        entry.group = (mapped && _wifiman_scanGroupOf[scanIndex] != (uint8_t)-1 ? &_wifiman_scanGroups[_wifiman_scanGroupOf[scanIndex]] : nullptr);
+
+        if (entry.record == nullptr || ! _wifiman_filterMatches(filter, &entry))
+            continue;
+        if (! visitor(context, &entry))
+            break;
+    }
+
+    return WMRT_SUCCESS;
+}
+
+WM_ReturnCode wifiman_visitSaved(const WM_ScanFilter *filter, WM_ScanVisitor visitor, void *context)
+{
+    assert(visitor != nullptr);
+
+    WM_SharedData *data = _wifiman_data;
+    WM_SCAN_LOCK();
+    auto scanResult = WiFi.scanComplete();
+    bool mapped = (scanResult > 0 && _wifiman_updateScanMap(data));
+    if (scanResult > UINT8_MAX)
+        scanResult = UINT8_MAX;
+
+    for (int n = 0; n < data->length; ++n)
+    {
+        WM_ScanEntry entry;
+        entry.networkIndex = n;
+        entry.scanIndex = -1;
+        entry.record = nullptr;
+        entry.group = nullptr;
+
+        if (mapped)
+        {
+            for (int g = 0; g < _wifiman_scanGroupCount && _wifiman_testBit(&data->inRange, n); ++g)
+            {
+                if (_wifiman_scanGroups[g].networkIndex != n)
+                    continue;
+
+                entry.group = &_wifiman_scanGroups[g];
+                entry.scanIndex = entry.group->scanIndex;
+                entry.record = (const wifi_ap_record_t*)WiFi.getScanInfoByIndex(entry.scanIndex);
+                break;
+            }
+        }
+        else
+        {
+            for (int i = 0; i < scanResult; ++i)
+            {
+                if (wifiman_findNetworkInList(data, _wifiman_scanSSID(i)) != n)
+                    continue;
+
+                // same SSID on several access points: keep the strongest
+                const wifi_ap_record_t *record = (const wifi_ap_record_t*)WiFi.getScanInfoByIndex(i);
+                if (record != nullptr && (entry.record == nullptr || record->rssi > entry.record->rssi))
+                {
+                    entry.scanIndex = i;
+                    entry.record = record;
+                }
+            }
+        }
+
+        if (! _wifiman_filterMatches(filter, &entry))
+            continue;
+        if (! visitor(context, &entry))
+            break;
+    }
+
+    return WMRT_SUCCESS;
+}
+#endif
+
+#if WM_FEATURE_AUTOCONNECT
+static void _wifiman_checkConnection()
+{
+    if (WiFi.status() == WL_CONNECTED)
+    {
+        uint8_t target = _wifiman_data->status.targetNetwork;
+        if (target >= _wifiman_data->length || _wifiman_data->networks[target]->uplink != UPLINK_OFFLINE)
+        {
+            WM_LOG("[WIFIMAN] Checking connection...already connected\n");
+            return;
+        }
+        WM_LOG("[WIFIMAN] Checking connection...connected, but no uplink\n");
+    }
+    if (wifiman_countUsableNetworks(_wifiman_data) == 0)
+    {
+        WM_LOG("[WIFIMAN] Checking connection...no usable networks\n");
+        return;
+    }
+
+    WM_LOG("[WIFIMAN] Checking connection...trying to connect\n");
+    int8_t status = wifiman_connectToBestWifi(_wifiman_data);
+
+    WM_LOG("[WIFIMAN] connect to best wifi returned: %d\n", status);
+
+    // Turn on periodic background scans, if no saved network is in range
+    // so we connect as soon, as a suitable network moves into range
+    if (status == WMRT_NETWORK_NOT_IN_LIST)
+        _wifiman_scanResume();
+    else
+        _wifiman_scanPause();
+}
+#endif
+
+static void _wifiman_wifiConnectedEvent(arduino_event_t *event)
+{
+    WM_TRACE_EVENT(WM_TRACE_EVENT_CONNECTED, 0);
+#if WM_FEATURE_TRACE
+    if (_wifiman_traceConnectOpen)
+        WM_TRACE_RADIO(WM_TRACE_RADIO_CONNECT, 'E', 0);
+    _wifiman_traceConnectOpen = false;
+#endif
+
+    WM_LOG("[WIFIMAN] Connected to \"%.*s\" after %d attempts\n", 
+        event->event_info.wifi_sta_connected.ssid_len,
+        (char*)(event->event_info.wifi_sta_connected.ssid), 
+        _wifiman_retryCount + 1);
+
+    uint8_t index = wifiman_findNetworkInList(_wifiman_data, event->event_info.wifi_sta_connected.ssid, event->event_info.wifi_sta_connected.ssid_len);
+
+#if WM_FEATURE_DIAGNOSTICS
+#if WM_FEATURE_PMK_CACHE
+    _wifiman_addTiming(_wifiman_pmkUsed ? &_wifiman_radioStats.associationCachedPMK : &_wifiman_radioStats.association, _wifiman_associationStartTime);
+#else
+    _wifiman_addTiming(&_wifiman_radioStats.association, _wifiman_associationStartTime);
+#endif
+    _wifiman_connectedTime = millis();
+    _wifiman_attemptRSSIBucket = -1;
+#endif
+#if WM_FEATURE_ENERGY
+    _wifiman_endActivity(WM_ACTIVITY_CONNECT);
+    _wifiman_beginActivity(WM_ACTIVITY_CONNECTED);
+#endif
+    
+    _wifiman_data->status.code = CONNECTED;
+    _wifiman_data->status.targetNetwork = index;
+    _wifiman_data->status.connectAttempts = _wifiman_retryCount + 1;
+    _wifiman_notifyStatus(_wifiman_data);
+    
+    if (index >= _wifiman_data->length)
+        return;
+
+    _wifiman_retryCount = 0;
+
+    _wifiman_setState(_wifiman_data, index, NETWORK_WORKED_BEFORE);
+    _wifiman_data->networks[index]->channel = event->event_info.wifi_sta_connected.channel;
+
+    WM_METRIC_INC(connectSuccesses);
+#if WM_FEATURE_METRICS
+    ++_wifiman_data->networks[index]->connectSuccesses;
+#endif
+
+#if WM_FEATURE_AUTOCONNECT
+    if (_wifiman_autoConnect)
+        _wifiman_scanPause();
+#endif
+}
+
+static void _wifiman_wifiGotIPEvent(arduino_event_t *event)
+{
+    WM_TRACE_EVENT(WM_TRACE_EVENT_GOT_IP, 0);
+
+    // DHCP done, connecting is finished
+    WM_SET_RADIO_FLAG(WM_RADIO_ASSOCIATED, true);
+    WM_SET_RADIO_FLAG(WM_RADIO_CONNECTING, false);
+#if WM_FEATURE_WATCHDOG
+    _wifiman_attemptStartTime = 0;
+    _wifiman_watchdogStrikes = 0;
+#endif
+
+#if WM_FEATURE_DIAGNOSTICS
+    _wifiman_addTiming(&_wifiman_radioStats.dhcp, _wifiman_connectedTime);
+    if (_wifiman_radioStats.bootToConnectMs == 0)
+        _wifiman_radioStats.bootToConnectMs = millis();
+#endif
+
+    if (_wifiman_connectRequestTime != 0)
+    {
+#if WM_FEATURE_DIAGNOSTICS
+        _wifiman_addTiming(&_wifiman_radioStats.timeToConnect, _wifiman_connectRequestTime);
+#endif
+#if WM_FEATURE_METRICS
+        uint32_t timeToConnect = millis() - _wifiman_connectRequestTime;
+        uint8_t bucket = 0;
+        while (bucket < WM_TTC_BUCKETS - 1 && timeToConnect > _wifiman_ttcBucketsMs[bucket])
+            ++bucket;
+        ++_wifiman_metrics.timeToConnect[bucket];
+        _wifiman_metrics.timeToConnectSumMs += timeToConnect;
+#endif
+        _wifiman_connectRequestTime = 0;
+    }
+
+#if WM_FEATURE_PMK_CACHE
+    // The passphrase worked, derive the PMK for the next connect
+    uint8_t connected = _wifiman_data->status.targetNetwork;
+    if (! _wifiman_pmkUsed && connected < _wifiman_data->length && ! _wifiman_hasPMK(_wifiman_data->networks[connected]))
+        _wifiman_pmkPending = connected;
+    // the PMK worked, a later link loss must not drop it
+    _wifiman_pmkUsed = false;
+#endif
+
+#if WM_FEATURE_ROAMING
+    // Ask the AP for its neighbors, a reconnect scans their channels first
+    uint8_t current = _wifiman_data->status.targetNetwork;
+    if (current < _wifiman_data->length &&
+            esp_rrm_send_neighbor_rep_request(&_wifiman_neighborReport, (void*)(uintptr_t)current) != 0)
+    {
+        WM_LOG("[WIFIMAN] Neighbor report not supported by AP\n");
+    }
+#endif
+
+#if WM_FEATURE_UPLINK_PROBE
+    uint8_t index = _wifiman_data->status.targetNetwork;
+
+    if (_wifiman_probeMode == WM_PROBE_NONE || index >= _wifiman_data->length)
+        return;
+
+    _wifiman_probe(index);
+#endif
+}
+
+static void _wifiman_wifiDisconnectedEvent(arduino_event_t *event)
+{
+    WM_TRACE_EVENT(WM_TRACE_EVENT_DISCONNECTED, event->event_info.wifi_sta_disconnected.reason);
+#if WM_FEATURE_TRACE
+    // An ASSOC_LEAVE during an attempt is our own disconnect right before it
+    if (! _wifiman_traceConnectOpen)
+        WM_TRACE_RADIO(WM_TRACE_RADIO_LINK_LOST, 'i', event->event_info.wifi_sta_disconnected.reason);
+    else if (event->event_info.wifi_sta_disconnected.reason != WIFI_REASON_ASSOC_LEAVE)
+    {
+        WM_TRACE_RADIO(WM_TRACE_RADIO_CONNECT, 'E', event->event_info.wifi_sta_disconnected.reason);
+        _wifiman_traceConnectOpen = false;
+    }
+#endif
+
+    WM_LOG("[WIFIMAN] Disconnected from \"%.*s\", reason: %d\n", 
+        event->event_info.wifi_sta_disconnected.ssid_len,
+        (char*)(event->event_info.wifi_sta_disconnected.ssid), 
+        event->event_info.wifi_sta_disconnected.reason);
+
+    uint8_t index = wifiman_findNetworkInList(_wifiman_data, event->event_info.wifi_sta_disconnected.ssid, event->event_info.wifi_sta_disconnected.ssid_len);
+
+    // https://espressif-docs.readthedocs-hosted.com/projects/espressif-esp-faq/en/latest/software-framework/wifi.html#connect-while-esp32-connecting-wi-fi-how-can-i-determine-the-reason-of-failure-by-error-codes
+    // https://github.com/espressif/esp-idf/issues/3349#issuecomment-485764274
+    // https://docs.espressif.com/projects/esp-idf/en/latest/esp32/api-guides/wifi.html#wi-fi-reason-code
+    switch (event->event_info.wifi_sta_disconnected.reason)
+    {
+        case WIFI_REASON_ASSOC_LEAVE: // after calling WiFi.disconnect()
+        case WIFI_REASON_AUTH_LEAVE:  // network was shut down
+            _wifiman_data->status.code = DISCONNECTED;
+            break;
+        case WIFI_REASON_NO_AP_FOUND: // SSID not found
+            _wifiman_data->status.code = NETWORK_NOT_FOUND;
+            break;
+        case WIFI_REASON_4WAY_HANDSHAKE_TIMEOUT: // wrong password
+        case WIFI_REASON_HANDSHAKE_TIMEOUT: // wrong password (less common)
+        case WIFI_REASON_AUTH_FAIL: // generic fail (happens sometimes, hard to pin down)
+        case WIFI_REASON_AUTH_EXPIRE: // i.e. when reconnecting to phone hotspot with phone on standby
+        default:
+#if WM_FEATURE_PMK_CACHE
+            // The passphrase might have changed on the AP, retry without the PMK
+            if (_wifiman_pmkUsed && index < _wifiman_data->length)
+            {
+                _wifiman_dropPMK(_wifiman_data->networks[index]);
+                _wifiman_pmkUsed = false;
+            }
+#endif
+            if (index < _wifiman_data->length && 
+                    ! WM_Policies::Retry::shouldRetry(_wifiman_retryCount, _wifiman_maxRetries, event->event_info.wifi_sta_disconnected.reason))
+                _wifiman_setState(_wifiman_data, index, NETWORK_FAILED_BEFORE);
+            _wifiman_data->status.code = CONNECTION_FAILED;
+            break;
+    }
+    
+    _wifiman_data->status.targetNetwork = index;
+    _wifiman_data->status.disconnectReason = event->event_info.wifi_sta_disconnected.reason;
+
+#if WM_FEATURE_ENERGY
+    _wifiman_endActivity(WM_ACTIVITY_CONNECTED);
+    // ASSOC_LEAVE is our own disconnect right before the next attempt
+    if (event->event_info.wifi_sta_disconnected.reason != WIFI_REASON_ASSOC_LEAVE)
+        _wifiman_endActivity(WM_ACTIVITY_CONNECT);
+#endif
+    WM_SET_RADIO_FLAG(WM_RADIO_ASSOCIATED, false);
+    if (event->event_info.wifi_sta_disconnected.reason != WIFI_REASON_ASSOC_LEAVE)
+        WM_SET_RADIO_FLAG(WM_RADIO_CONNECTING, false);
+#if WM_FEATURE_WATCHDOG
+    // The attempt has a result, the driver is alive (our own ASSOC_LEAVE
+    // belongs to the previous attempt)
+    if (event->event_info.wifi_sta_disconnected.reason != WIFI_REASON_ASSOC_LEAVE)
+    {
+        _wifiman_attemptStartTime = 0;
+        _wifiman_watchdogStrikes = 0;
+    }
+    // The application disconnected, nothing to recover
+    else if (! __atomic_exchange_n(&_wifiman_ownDisconnect, false, __ATOMIC_ACQ_REL))
+        _wifiman_attemptStartTime = 0;
+#endif
+
+#if WM_FEATURE_DIAGNOSTICS
+    // intentional disconnects (i.e. before the next attempt) do not count
+    if (_wifiman_attemptRSSIBucket >= 0 && _wifiman_data->status.code != DISCONNECTED)
+    {
+        ++_wifiman_radioStats.failuresByRSSI[_wifiman_attemptRSSIBucket];
+        _wifiman_attemptRSSIBucket = -1;
+    }
+#endif
+
+    if (index < _wifiman_data->length && 
+            WM_Policies::Retry::shouldRetry(_wifiman_retryCount, _wifiman_maxRetries, event->event_info.wifi_sta_disconnected.reason))
+    {
+        WM_LOG("[WIFIMAN] Attempting to reconnect to %s (attempt #%d)\n", (char*)(event->event_info.wifi_sta_disconnected.ssid), _wifiman_retryCount + 1);
+
+        _wifiman_connect(index, false, WM_Policies::Retry::backoffMs(_wifiman_retryCount, _wifiman_backoffBase, _wifiman_backoffMax));
+
+        ++_wifiman_retryCount;
+        WM_METRIC_INC(retries);
+    }
+    else 
+    {
+        _wifiman_notifyStatus(_wifiman_data);
+
+#if WM_FEATURE_AUTOCONNECT
+        if (_wifiman_autoConnect && event->event_info.wifi_sta_disconnected.reason != WIFI_REASON_ASSOC_LEAVE)
+            _wifiman_checkConnection();
+#endif
+    }
+}
+
+#if WM_FEATURE_AUTOCONNECT
+static void _wifiman_wifiScanDoneEvent(arduino_event_t *event)
+{
+    WM_TRACE_EVENT(WM_TRACE_EVENT_SCAN_DONE, event->event_info.wifi_scan_done.number);
+    WM_TRACE_RADIO(WM_TRACE_RADIO_SCAN, 'E', event->event_info.wifi_scan_done.number);
+
+    WM_LOG("[WIFIMAN] Scan done! Networks found: %d, scan id %d, status %d\n", event->event_info.wifi_scan_done.number, event->event_info.wifi_scan_done.scan_id, event->event_info.wifi_scan_done.status);
+
+    _wifiman_scanTime = millis();
+    ++_wifiman_scanGeneration;
+
+#if WM_FEATURE_DIAGNOSTICS
+    if (_wifiman_scanStartTime != 0)
+    {
+        _wifiman_addTiming(_wifiman_scanStartPassive ? &_wifiman_radioStats.scanPassive : &_wifiman_radioStats.scanActive, _wifiman_scanStartTime);
+        _wifiman_scanStartTime = 0;
+    }
+#endif
+#if WM_FEATURE_ENERGY
+    _wifiman_endActivity(WM_ACTIVITY_SCAN_ACTIVE);
+    _wifiman_endActivity(WM_ACTIVITY_SCAN_PASSIVE);
+#endif
+    _wifiman_updateScanMap(_wifiman_data);
+
+#if WM_FEATURE_FAST_SCAN
+    // Next channel of the sweep is already running
+    if (_wifiman_sweepActive && _wifiman_continueSweep())
+        return;
+#endif
+    WM_SET_RADIO_FLAG(WM_RADIO_SCANNING, false);
+
+#if WM_FEATURE_WAITERS
+    WM_Status status = _wifiman_data->status;
+    _wifiman_fireWaiters(WM_WAIT_SCAN_DONE, &status);
+#endif
+
+#if WM_FEATURE_PERSISTENCE
+    // wifiman_startAsync: connect once the list is loaded as well
+    if (__atomic_load_n(&_wifiman_bootPending, __ATOMIC_ACQUIRE) != 0)
+    {
+        _wifiman_bootDone();
+        return;
+    }
+#endif
+
+    if (_wifiman_autoConnect)
+        _wifiman_checkConnection();
+}
+
+static void _wifiman_scanResume()
+{
+    WM_LOG("[WIFIMAN] Resuming wifi scan thread\n");
+    xTaskNotify(_wifiman_workerTaskHandle, 1, eSetValueWithOverwrite);
+}
+
+static void _wifiman_scanPause()
+{
+    WM_LOG("[WIFIMAN] Pausing wifi scan thread\n");
+    xTaskNotify(_wifiman_workerTaskHandle, 0, eSetValueWithOverwrite);
+}
+#endif
+
+static void _wifiman_doScan(ArduinoTime_t delay)
+{
+    WM_LOG("[WIFIMAN] Issuing scan command: %lu...\n", delay);
+    WM_TRACE(WM_TRACE_SCAN_ISSUED, 'i', 0);
+
+#if WM_FEATURE_WORKER
+    WM_TRACE(WM_TRACE_WAIT_SCAN_LOCK, 'B', 0);
+    xSemaphoreTake(nextScan.lock, portMAX_DELAY);
+    WM_TRACE(WM_TRACE_WAIT_SCAN_LOCK, 'E', 0);
+
+    nextScan.execTime = millis() + delay;
+    nextScan.handled = false;
+
+    xSemaphoreGive(nextScan.lock);
+#else
+    _wifiman_startScan();
+#endif
+}
+
+static void _wifiman_connect(uint8_t index, bool byUser, ArduinoTime_t delay)
+{
+    WM_LOG("[WIFIMAN] Issuing connect command: %d, %d, %lu...\n", index, byUser, delay);
+    WM_TRACE(WM_TRACE_CONNECT_ISSUED, 'i', index);
+
+#if WM_FEATURE_WORKER
+    WM_TRACE(WM_TRACE_WAIT_CONNECT_LOCK, 'B', index);
+    xSemaphoreTake(nextConnect.lock, portMAX_DELAY);
+    WM_TRACE(WM_TRACE_WAIT_CONNECT_LOCK, 'E', index);
+
+    nextConnect.execTime = millis() + delay;
+    nextConnect.networkIndex = index;
+    nextConnect.issuedByUser = byUser;
+    nextConnect.handled = false;
+
+    xSemaphoreGive(nextConnect.lock);
+#else
+    // Nobody to delay the command for us, so connect right away (no backoff)
+    _wifiman_beginConnect(index);
+#endif
+}
+
+// channel 0 scans all channels
+// Returns true if a scan was started
+static bool _wifiman_startScan(uint8_t channel)
+{
+    WM_TRACE_SCOPE(WM_TRACE_SCAN_EXEC, channel);
+    // the previous result is deleted
+    WM_SCAN_LOCK();
+
+    if (WiFi.scanComplete() == WIFI_SCAN_RUNNING)
+        return false;
+
+#if WM_FEATURE_FAST_SCAN
+    if (channel == 0 && _wifiman_sweepRequested)
+    {
+        _wifiman_sweepRequested = false;
+        if (_wifiman_beginSweep())
+            return true;
+    }
+#endif
+
+    WiFi.scanDelete();
+    if (WiFi.scanNetworks(true, false, _wifiman_scanPassive, _wifiman_scanMsPerChannel, channel) == WIFI_SCAN_FAILED)
+        return false;
+    WM_METRIC_INC(scans);
+    WM_TRACE_RADIO(WM_TRACE_RADIO_SCAN, 'B', _wifiman_scanPassive);
+
+#if WM_FEATURE_DIAGNOSTICS
+    _wifiman_scanStartTime = millis();
+    _wifiman_scanStartPassive = _wifiman_scanPassive;
+#endif
+#if WM_FEATURE_ENERGY
+    _wifiman_beginActivity(_wifiman_scanPassive ? WM_ACTIVITY_SCAN_PASSIVE : WM_ACTIVITY_SCAN_ACTIVE);
+#endif
+#if WM_FEATURE_AUTOCONNECT
+    // cleared by the scan done handler
+    WM_SET_RADIO_FLAG(WM_RADIO_SCANNING, true);
+#endif
+
+    return true;
+}
+
+#if WM_FEATURE_FAST_SCAN
+// Start a channel sweep, channels saved networks were last seen on first
+// Returns false if there is no channel history (a full scan is faster then)
+static bool _wifiman_beginSweep()
+{
+    uint16_t added = 0; // bit per channel
+    _wifiman_sweepLength = 0;
+
+#if WM_FEATURE_ROAMING
+    // Access points of the network we are (or were) connected to, as
+    // reported by the AP itself
+    uint8_t current = _wifiman_data->status.targetNetwork;
+    uint16_t neighbors = (current < _wifiman_data->length ? _wifiman_data->networks[current]->neighborChannels : 0);
+
+    for (int channel = 1; channel <= WM_SCAN_CHANNELS; ++channel)
+    {
+        if ((neighbors & (1 << channel)) == 0)
+            continue;
+
+        _wifiman_sweepChannels[_wifiman_sweepLength++] = channel;
+        added |= (1 << channel);
+    }
+#endif
+
+    // Networks that worked before are the most likely ones
+    for (int pass = 0; pass < 2; ++pass)
+    {
+        for (int i = 0; i < _wifiman_data->length; ++i)
+        {
+            WM_WifiNetwork *network = _wifiman_data->networks[i];
+            uint8_t channel = network->channel;
+
+            if (channel == 0 || channel > WM_SCAN_CHANNELS || (added & (1 << channel)) != 0)
+                continue;
+            if (! _wifiman_testBit(&_wifiman_data->usable, i))
+                continue;
+            if ((pass == 0) != (network->state == NETWORK_WORKED_BEFORE))
+                continue;
+
+            _wifiman_sweepChannels[_wifiman_sweepLength++] = channel;
+            added |= (1 << channel);
+        }
+    }
+
+    if (_wifiman_sweepLength == 0)
+        return false;
+
+    for (int channel = 1; channel <= WM_SCAN_CHANNELS; ++channel)
+    {
+        if ((added & (1 << channel)) == 0)
+            _wifiman_sweepChannels[_wifiman_sweepLength++] = channel;
+    }
+
+    WM_LOG("[WIFIMAN] Starting channel sweep, first channel %d\n", _wifiman_sweepChannels[0]);
+
+    memset(&_wifiman_sweepInRange, 0, sizeof(_wifiman_sweepInRange));
+    _wifiman_sweepBestIndex = -1;
+    _wifiman_sweepBestScore = INT_MIN;
+    _wifiman_sweepActive = true;
+
+    for (_wifiman_sweepPos = 0; _wifiman_sweepPos < _wifiman_sweepLength; ++_wifiman_sweepPos)
+    {
+        if (_wifiman_startScan(_wifiman_sweepChannels[_wifiman_sweepPos]))
+            return true;
+    }
+
+    _wifiman_sweepActive = false;
+    return false;
+}
+
+// Evaluate the result of the current sweep channel (called on scan done)
+// Returns true if the next channel is being scanned
+static bool _wifiman_continueSweep()
+{
+    WM_SharedData *data = _wifiman_data;
+    bool connected = (WiFi.status() == WL_CONNECTED);
+    WM_SCAN_LOCK();
+    bool mapped = _wifiman_updateScanMap(data);
+    int16_t scanResult = WiFi.scanComplete();
+
+    for (int i = 0; mapped && i < scanResult; ++i)
+    {
+        uint8_t index = _wifiman_scanMap[i];
+        if (index >= data->length)
+            continue;
+
+        if (! _wifiman_testBit(&_wifiman_sweepInRange, index) || WiFi.RSSI(i) > _wifiman_sweepRSSI[index])
+            _wifiman_sweepRSSI[index] = WiFi.RSSI(i);
+        _wifiman_setBit(&_wifiman_sweepInRange, index, true);
+
+        if (! _wifiman_testBit(&data->usable, index))
+            continue;
+
+        int score = WM_Policies::Scoring::score(data->networks[index], WiFi.RSSI(i), connected);
+        if (score != WM_SCORE_SKIP && score > _wifiman_sweepBestScore)
+        {
+            _wifiman_sweepBestScore = score;
+            _wifiman_sweepBestIndex = index;
+        }
+    }
+
+    data->inRange = _wifiman_sweepInRange;
+
+    bool goodEnough = (_wifiman_sweepBestIndex != (uint8_t)-1 && _wifiman_sweepBestScore >= _wifiman_fastScanGoodScore);
+
+    WM_LOG("[WIFIMAN] Sweep channel %d done, best score %d%s\n", _wifiman_sweepChannels[_wifiman_sweepPos], _wifiman_sweepBestScore, goodEnough ? " (good enough)" : "");
+
+    ++_wifiman_sweepPos;
+
+    if (! goodEnough)
+    {
+        for (; _wifiman_sweepPos < _wifiman_sweepLength; ++_wifiman_sweepPos)
+        {
+            if (_wifiman_startScan(_wifiman_sweepChannels[_wifiman_sweepPos]))
+                return true;
+        }
+    }
+    else if (_wifiman_sweepPos < _wifiman_sweepLength && _wifiman_fastScanFinishLater)
+    {
+        _wifiman_doScan(WM_FAST_SCAN_FINISH_DELAY_MS);
+    }
+
+    _wifiman_sweepActive = false;
+    _wifiman_sweepPartial = (_wifiman_sweepPos < _wifiman_sweepLength);
+    _wifiman_sweepGeneration = _wifiman_scanGeneration;
+
+    return false;
+}
+#endif
+
+#if WM_FEATURE_WATCHDOG
+// Runs in the worker once a second
+static void _wifiman_watchdogCheck()
+{
+    ArduinoTime_t now = millis();
+
+    // Also covers scans not started by wifiman, they block ours as well
+    if (WiFi.scanComplete() != WIFI_SCAN_RUNNING)
+    {
+        // finished (or aborted) after a recovery
+        if (_wifiman_scanRunningSince != 0)
+            _wifiman_watchdogStrikes = 0;
+        _wifiman_scanRunningSince = 0;
+    }
+    else if (_wifiman_scanRunningSince == 0)
+        _wifiman_scanRunningSince = now;
+    else if (now - _wifiman_scanRunningSince > (uint32_t)_wifiman_scanMsPerChannel * WM_WATCHDOG_SCAN_CHANNELS + WM_WATCHDOG_SCAN_MS)
+    {
+        WM_LOG("[WIFIMAN-THREAD] Watchdog: scan running for %lu ms\n", now - _wifiman_scanRunningSince);
+        // next deadline for the abort itself
+        _wifiman_scanRunningSince = now;
+        _wifiman_recover(WM_RECOVERY_ABORT_SCAN);
+    }
+
+    ArduinoTime_t attemptStart = _wifiman_attemptStartTime;
+    if (attemptStart != 0 && now - attemptStart > WM_WATCHDOG_CONNECT_MS)
+    {
+        WM_LOG("[WIFIMAN-THREAD] Watchdog: no connect result for %lu ms\n", now - attemptStart);
+        _wifiman_attemptStartTime = 0;
+        _wifiman_recover(WM_RECOVERY_RESTART_CONNECT);
+    }
+}
+
+// Runs in the esp_timer task, the worker cannot notice its own starvation
+static void _wifiman_watchdogTimerCallback(void *context)
+{
+    ArduinoTime_t heartbeat = __atomic_load_n(&_wifiman_workerHeartbeat, __ATOMIC_ACQUIRE);
+    if (millis() - heartbeat <= WM_WATCHDOG_WORKER_MS || __atomic_load_n(&_wifiman_workerBoosted, __ATOMIC_ACQUIRE))
+        return;
+
+    WM_LOG("[WIFIMAN] Watchdog: worker stalled for %lu ms, raising its priority\n", millis() - heartbeat);
+
+    // lowered again by the worker in its next iteration
+    __atomic_store_n(&_wifiman_workerBoosted, true, __ATOMIC_RELEASE);
+    vTaskPrioritySet(_wifiman_workerTaskHandle, WM_WATCHDOG_BOOST_PRIORITY);
+    WM_METRIC_INC(recoveries[WM_RECOVERY_BOOST_WORKER]);
+}
+
+static void _wifiman_recover(_WM_Recovery action)
+{
+    // Only reconnect what was connected or connecting, an idle STA stays idle
+    // (the deadline of a restarted attempt is cleared already)
+    bool wasActive = (action == WM_RECOVERY_RESTART_CONNECT || WiFi.status() == WL_CONNECTED || _wifiman_attemptStartTime != 0);
+
+    // Stuck again without progress in between, the lighter recovery did not help
+    if (++_wifiman_watchdogStrikes > 1)
+        action = WM_RECOVERY_REINIT_DRIVER;
+
+    WM_METRIC_INC(recoveries[action]);
+    uint8_t target = _wifiman_data->status.targetNetwork;
+
+    switch (action)
+    {
+        case WM_RECOVERY_ABORT_SCAN:
+            WM_LOG("[WIFIMAN-THREAD] Watchdog: aborting scan\n");
+#if WM_FEATURE_FAST_SCAN
+            // the SCAN_DONE of the abort must not continue the sweep
+            _wifiman_sweepActive = false;
+#endif
+            esp_wifi_scan_stop();
+            break;
+        case WM_RECOVERY_RESTART_CONNECT:
+            WM_LOG("[WIFIMAN-THREAD] Watchdog: restarting connect attempt\n");
+            if (wasActive && target < _wifiman_data->length)
+                _wifiman_connect(target, false, 0);
+#if WM_FEATURE_AUTOCONNECT
+            else if (_wifiman_autoConnect)
+                _wifiman_checkConnection();
+#endif
+            break;
+        default:
+            WM_LOG("[WIFIMAN-THREAD] Watchdog: reinitializing STA driver\n");
+#if WM_FEATURE_FAST_SCAN
+            _wifiman_sweepActive = false;
+#endif
+            // Restart in the same mode, an AP+STA device keeps its soft-AP
+            wifi_mode_t mode = (wifi_mode_t)(WiFi.getMode() | WIFI_STA);
+            __atomic_store_n(&_wifiman_ownDisconnect, wasActive, __ATOMIC_RELEASE);
+            WiFi.mode(WIFI_OFF);
+            // No SCAN_DONE of the stuck scan will clear it anymore
+            WiFi.clearStatusBits(WIFI_SCANNING_BIT);
+            WiFi.mode(mode);
+
+            _wifiman_scanRunningSince = 0;
+            _wifiman_attemptStartTime = 0;
+#if WM_FEATURE_DIAGNOSTICS
+            _wifiman_scanStartTime = 0;
+#endif
+#if WM_FEATURE_ENERGY
+            _wifiman_endActivity(WM_ACTIVITY_SCAN_ACTIVE);
+            _wifiman_endActivity(WM_ACTIVITY_SCAN_PASSIVE);
+            _wifiman_endActivity(WM_ACTIVITY_CONNECT);
+            _wifiman_endActivity(WM_ACTIVITY_CONNECTED);
+#endif
+            WM_SET_RADIO_FLAG(WM_RADIO_SCANNING, false);
+            WM_SET_RADIO_FLAG(WM_RADIO_CONNECTING, false);
+            WM_SET_RADIO_FLAG(WM_RADIO_ASSOCIATED, false);
+
+            // The driver dropped any connection, start over
+            if (wasActive && target < _wifiman_data->length)
+                _wifiman_connect(target, false, 0);
+#if WM_FEATURE_AUTOCONNECT
+            else if (_wifiman_autoConnect)
+                _wifiman_checkConnection();
+#endif
+            break;
+    }
+}
+#endif
+
+#if WM_FEATURE_PMK_CACHE
+static uint32_t _wifiman_pmkKey(const char *ssid, const char *pass)
+{
+    // FNV-1a over SSID and passphrase (including the terminators)
+    uint32_t hash = 0x811c9dc5;
+    for (const char *text : { ssid, pass })
+    {
+        for (const char *c = text; ; ++c)
+        {
+            hash = (hash ^ (uint8_t)*c) * 0x01000193;
+            if (*c == 0)
+                break;
+        }
+    }
+
+    return (hash == 0 ? 1 : hash);
+}
+
+// Cache key of the network (0 if it has no passphrase a PMK is derived from)
+static uint32_t _wifiman_pmkKeyOf(const WM_WifiNetwork *network)
+{
+    // a 64 digit pass is a PMK already
+    size_t length = (network->pass == nullptr ? 0 : strlen(network->pass));
+    if (length < 8 || length > 63)
+        return 0;
+
+    return _wifiman_pmkKey(network->ssid, network->pass);
+}
+
+// Slot of the key (or -1), call with _wifiman_pmkMux held
+static int _wifiman_findPMK(uint32_t key)
+{
+    for (int i = 0; i < WM_PMK_CACHE_SIZE; ++i)
+    {
+        if (_wifiman_pmkCache[i].key == key)
+            return i;
+    }
+
+    return -1;
+}
+
+static bool _wifiman_hasPMK(const WM_WifiNetwork *network)
+{
+    uint32_t key = _wifiman_pmkKeyOf(network);
+    if (key == 0)
+        return false;
+
+    portENTER_CRITICAL(&_wifiman_pmkMux);
+    int slot = _wifiman_findPMK(key);
+    portEXIT_CRITICAL(&_wifiman_pmkMux);
+
+    return slot >= 0;
+}
+
+static void _wifiman_dropPMK(const WM_WifiNetwork *network)
+{
+    uint32_t key = _wifiman_pmkKeyOf(network);
+    if (key == 0)
+        return;
+
+    portENTER_CRITICAL(&_wifiman_pmkMux);
+    int slot = _wifiman_findPMK(key);
+    if (slot >= 0)
+        _wifiman_pmkCache[slot].key = 0;
+    portEXIT_CRITICAL(&_wifiman_pmkMux);
+}
+
+// Passphrase or cached PMK (as 64 hex digits in pmkHex) for WiFi.begin
+static const char* _wifiman_connectPass(uint8_t index, char pmkHex[65])
+{
+    WM_WifiNetwork *network = _wifiman_data->networks[index];
+    _wifiman_pmkUsed = false;
+
+    // A PMK forces WPA2-PSK, so only use it if no access point of the
+    // network offers anything else (i.e. WPA3 transition mode)
+    uint8_t authMode = WIFI_AUTH_MAX;
+    {
+        WM_SCAN_LOCK();
+        const WM_ScanGroup *groups = nullptr;
+        uint8_t groupCount = wifiman_getScanGroups(&groups);
+        for (int g = 0; g < groupCount; ++g)
+        {
+            if (groups[g].networkIndex == index)
+                authMode = groups[g].authMode;
+        }
+    }
+
+    if (authMode != WIFI_AUTH_WPA_PSK && authMode != WIFI_AUTH_WPA2_PSK && authMode != WIFI_AUTH_WPA_WPA2_PSK)
+        return network->pass;
+
+    uint32_t key = _wifiman_pmkKeyOf(network);
+    if (key == 0)
+        return network->pass;
+
+    // copy, the worker might replace the entry right after
+    uint8_t pmk[32];
+    portENTER_CRITICAL(&_wifiman_pmkMux);
+    int slot = _wifiman_findPMK(key);
+    if (slot >= 0)
+    {
+        _wifiman_pmkCache[slot].lastUsed = ++_wifiman_pmkUseCounter;
+        memcpy(pmk, _wifiman_pmkCache[slot].pmk, sizeof(pmk));
+    }
+    portEXIT_CRITICAL(&_wifiman_pmkMux);
+
+    if (slot < 0)
+        return network->pass;
+
+    for (int i = 0; i < 32; ++i)
+        snprintf(pmkHex + i * 2, 3, "%02x", pmk[i]);
+
+    _wifiman_pmkUsed = true;
+    return pmkHex;
+}
+
+// PMK = PBKDF2-HMAC-SHA1(passphrase, SSID, 4096 rounds, 32 bytes)
+static void _wifiman_derivePMK(uint8_t index)
+{
+    if (index >= _wifiman_data->length)
+        return;
+
+    // copy, the list might change while we are busy
+    WM_WifiNetwork *network = _wifiman_data->networks[index];
+    char ssid[33];
+    char pass[64];
+    if (_wifiman_pmkKeyOf(network) == 0 || strlen(network->ssid) >= sizeof(ssid))
+        return;
+    strcpy(ssid, network->ssid);
+    strcpy(pass, network->pass);
+
+    uint8_t pmk[32];
+    mbedtls_md_context_t md;
+    mbedtls_md_init(&md);
+    bool derived = (mbedtls_md_setup(&md, mbedtls_md_info_from_type(MBEDTLS_MD_SHA1), 1) == 0 &&
+            mbedtls_pkcs5_pbkdf2_hmac(&md, (const unsigned char*)pass, strlen(pass),
+                (const unsigned char*)ssid, strlen(ssid), 4096, sizeof(pmk), pmk) == 0);
+    mbedtls_md_free(&md);
+
+    if (! derived)
+        return;
+
+    // Only keep it if the network was neither deleted nor changed meanwhile
+    uint32_t key = _wifiman_pmkKey(ssid, pass);
+    index = wifiman_findNetworkInList(_wifiman_data, ssid);
+    if (index >= _wifiman_data->length || _wifiman_pmkKeyOf(_wifiman_data->networks[index]) != key)
+    {
+        WM_LOG("[WIFIMAN-THREAD] PMK for \"%s\" dropped, network changed\n", ssid);
+        return;
+    }
+
+    WM_LOG("[WIFIMAN-THREAD] PMK for \"%s\" derived\n", ssid);
+
+    portENTER_CRITICAL(&_wifiman_pmkMux);
+    // same key (derived twice), else least recently used (or unused) slot
+    int slot = _wifiman_findPMK(key);
+    if (slot < 0)
+    {
+        slot = 0;
+        for (int i = 1; i < WM_PMK_CACHE_SIZE; ++i)
+        {
+            if (_wifiman_pmkCache[i].key == 0 || (_wifiman_pmkCache[slot].key != 0 && _wifiman_pmkCache[i].lastUsed < _wifiman_pmkCache[slot].lastUsed))
+                slot = i;
+        }
+    }
+    memcpy(_wifiman_pmkCache[slot].pmk, pmk, sizeof(pmk));
+    _wifiman_pmkCache[slot].lastUsed = ++_wifiman_pmkUseCounter;
+    _wifiman_pmkCache[slot].key = key;
+    portEXIT_CRITICAL(&_wifiman_pmkMux);
+}
+
+void wifiman_clearPMKCache()
+{
+    portENTER_CRITICAL(&_wifiman_pmkMux);
+    memset(_wifiman_pmkCache, 0, sizeof(_wifiman_pmkCache));
+    portEXIT_CRITICAL(&_wifiman_pmkMux);
+}
+#endif
+
+#if WM_FEATURE_ROAMING
+// Called by the supplicant with the neighbor report elements of the AP
+// (IEEE 802.11-2016 9.4.2.37: id 52, length, BSSID, BSSID info, operating
+// class, channel, PHY type, optional subelements)
+static void _wifiman_neighborReport(void *context, const uint8_t *report, size_t length)
+{
+    uint8_t index = (uint8_t)(uintptr_t)context;
+    uint16_t channels = 0;
+
+    while (report != nullptr && length >= 2 && length >= 2u + report[1])
+    {
+        uint8_t elementLength = report[1];
+        if (report[0] == 52 && elementLength >= 13)
+        {
+            uint8_t channel = report[2 + 11];
+            if (channel >= 1 && channel <= WM_SCAN_CHANNELS)
+                channels |= (1 << channel);
+        }
+
+        report += 2 + elementLength;
+        length -= 2 + elementLength;
+    }
+
+    // the list might have changed since the request
+    if (index >= _wifiman_data->length || index != _wifiman_data->status.targetNetwork)
+        return;
+
+    WM_LOG("[WIFIMAN] Neighbor report for \"%s\", channels 0x%04x\n", _wifiman_data->networks[index]->ssid, channels);
+    _wifiman_data->networks[index]->neighborChannels = channels;
+}
+#endif
+
+static void _wifiman_beginConnect(uint8_t index)
+{
+    WM_TRACE_SCOPE(WM_TRACE_CONNECT_EXEC, index);
+
+#if WM_FEATURE_WATCHDOG
+    // Only a connected or connecting STA reports the disconnect
+    __atomic_store_n(&_wifiman_ownDisconnect, WiFi.status() == WL_CONNECTED || _wifiman_attemptStartTime != 0, __ATOMIC_RELEASE);
+#endif
+    WiFi.disconnect();
+#if WM_FEATURE_PMK_CACHE
+    char pmkHex[65];
+    const char *pass = _wifiman_connectPass(index, pmkHex);
+#else
+    const char *pass = _wifiman_data->networks[index]->pass;
+#endif
+#if WM_FEATURE_ROAMING
+    // Advertise radio measurement (neighbor reports) and BSS transition
+    // management in the association request, WiFi.begin does not set them
+    WiFi.begin(_wifiman_data->networks[index]->ssid, pass, 0, nullptr, false);
+
+    wifi_config_t config;
+    esp_wifi_get_config(WIFI_IF_STA, &config);
+    config.sta.rm_enabled = 1;
+    config.sta.btm_enabled = 1;
+    esp_wifi_set_config(WIFI_IF_STA, &config);
+    esp_wifi_connect();
+#else
+    WiFi.begin(_wifiman_data->networks[index]->ssid, pass);
+#endif
+#if WM_FEATURE_ENERGY
+    _wifiman_endActivity(WM_ACTIVITY_CONNECTED);
+    _wifiman_beginActivity(WM_ACTIVITY_CONNECT);
+#endif
+    WM_SET_RADIO_FLAG(WM_RADIO_ASSOCIATED, false);
+    WM_SET_RADIO_FLAG(WM_RADIO_CONNECTING, true);
+#if WM_FEATURE_TRACE
+    // an attempt without result yet is superseded
+    if (_wifiman_traceConnectOpen)
+        WM_TRACE_RADIO(WM_TRACE_RADIO_CONNECT, 'E', WIFI_REASON_ASSOC_LEAVE);
+    _wifiman_traceConnectOpen = true;
+#endif
+    WM_TRACE_RADIO(WM_TRACE_RADIO_CONNECT, 'B', index);
+
+    WM_METRIC_INC(connectAttempts);
+#if WM_FEATURE_METRICS
+    ++_wifiman_data->networks[index]->connectAttempts;
+#endif
+#if WM_FEATURE_WATCHDOG
+    _wifiman_attemptStartTime = millis();
+#endif
+
+#if WM_FEATURE_DIAGNOSTICS
+    _wifiman_associationStartTime = millis();
+    _wifiman_attemptRSSIBucket = _wifiman_rssiBucket(index);
+    if (_wifiman_attemptRSSIBucket >= 0)
+        ++_wifiman_radioStats.attemptsByRSSI[_wifiman_attemptRSSIBucket];
+#endif
+}
+
+#if WM_FEATURE_DIAGNOSTICS
+static void _wifiman_addTiming(WM_TimingStat *stat, ArduinoTime_t start)
+{
+    uint32_t duration = millis() - start;
+
+    if (stat->count == 0 || duration < stat->minMs)
+        stat->minMs = duration;
+    if (duration > stat->maxMs)
+        stat->maxMs = duration;
+    stat->totalMs += duration;
+    ++stat->count;
+}
+
+// Bucket of the strongest RSSI of a network in the latest scan (or -1)
+static int8_t _wifiman_rssiBucket(uint8_t index)
+{
+    WM_SCAN_LOCK();
+    if (! _wifiman_updateScanMap(_wifiman_data))
+        return -1;
+
+    int bestRSSI = INT_MIN;
+    for (int i = 0; i < _wifiman_scanMapLength; ++i)
+    {
+        if (_wifiman_scanMap[i] == index && WiFi.RSSI(i) > bestRSSI)
+            bestRSSI = WiFi.RSSI(i);
+    }
+
+    if (bestRSSI == INT_MIN)
+        return -1;
+
+    return constrain((bestRSSI + 99) / 10, 0, WM_RSSI_BUCKETS - 1);
+}
+#endif
+
+#if WM_FEATURE_UPLINK_PROBE
+static void _wifiman_probe(uint8_t index)
+{
+    WM_LOG("[WIFIMAN] Issuing uplink probe command: %d...\n", index);
+
+    nextProbe.networkIndex = index;
+    nextProbe.handled = false;
+}
+
+// Runs in the worker task, since connecting to the probe host is blocking
+static void _wifiman_runUplinkProbe(uint8_t index)
+{
+    WM_TRACE_SCOPE(WM_TRACE_UPLINK_PROBE, index);
+
+    // connection might have changed since the probe was issued
+    if (WiFi.status() != WL_CONNECTED || index >= _wifiman_data->length || _wifiman_data->status.targetNetwork != index)
+        return;
+
+    WiFiClient client;
+    ArduinoTime_t start = millis();
+    bool success = client.connect(_wifiman_probeHost, _wifiman_probePort, _wifiman_probeTimeout);
+
+    if (success && _wifiman_probeMode == WM_PROBE_HTTP_204)
+    {
+        client.printf("GET %s HTTP/1.1\r\nHost: %s\r\nConnection: close\r\n\r\n", _wifiman_probePath, _wifiman_probeHost);
+
+        // Only the status line is of interest ("HTTP/1.1 204 No Content")
+        // Captive portals usually answer with 200 or a redirect
+        char statusLine[16] = "";
+        uint8_t pos = 0;
+        while (pos < sizeof(statusLine) - 1 && millis() - start < _wifiman_probeTimeout)
+        {
+            int c = client.read();
+            if (c < 0)
+            {
+                if (! client.connected())
+                    break;
+                delay(1);
+                continue;
+            }
+            if (c == '\r' || c == '\n')
+                break;
+            statusLine[pos++] = c;
+        }
+        statusLine[pos] = 0;
+
+        success = (strncmp(statusLine, "HTTP/1.", 7) == 0 && strncmp(statusLine + 8, " 204", 4) == 0);
+    }
+
+    ArduinoTime_t rtt = millis() - start;
+    client.stop();
+
+    WM_WifiNetwork *network = _wifiman_data->networks[index];
+
+    WM_LOG("[WIFIMAN-THREAD] Uplink probe on \"%s\": %s after %lums\n", network->ssid, success ? "online" : "FAILED", rtt);
+
+    if (success)
+    {
+        _wifiman_setUplink(_wifiman_data, index, UPLINK_ONLINE);
+        network->uplinkRTT = (rtt > UINT16_MAX ? UINT16_MAX : rtt);
+
+        _wifiman_data->status.code = ONLINE;
+        _wifiman_notifyStatus(_wifiman_data);
+    }
+    else
+    {
+        _wifiman_setUplink(_wifiman_data, index, UPLINK_OFFLINE);
+
+        // Look for a network with working uplink, we will stay connected
+        // if there is none
+#if WM_FEATURE_AUTOCONNECT
+        if (_wifiman_autoConnect)
+            _wifiman_checkConnection();
+#endif
+    }
+}
+#endif
+
+#if WM_FEATURE_METRICS
+static void _wifiman_printMetricHeader(Print *output, const char *name, const char *type, const char *help)
+{
+    output->print("# HELP ");
+    output->print(name);
+    output->print(" ");
+    output->print(help);
+    output->print("\n# TYPE ");
+    output->print(name);
+    output->print(" ");
+    output->print(type);
+    output->print("\n");
+}
+
+static void _wifiman_printMetricName(Print *output, const char *name, const char *suffix, const char *labelName, const char *labelValue)
+{
+    output->print(name);
+    if (suffix != nullptr)
+        output->print(suffix);
+
+    if (labelName == nullptr)
+        return;
+
+    output->print("{");
+    output->print(labelName);
+    output->print("=\"");
+    for (const char *c = labelValue; *c != 0; ++c)
+    {
+        if (*c == '\\' || *c == '"')
+            output->write('\\');
+        if (*c == '\n')
+            output->print("\\n");
+        else
+            output->write(*c);
+    }
+    output->print("\"}");
+}
+
+static void _wifiman_printMetric(Print *output, const char *name, uint32_t value, 
+        const char *labelName = nullptr, const char *labelValue = nullptr, const char *suffix = nullptr)
+{
+    _wifiman_printMetricName(output, name, suffix, labelName, labelValue);
+    output->print(" ");
+    output->print(value);
+    output->print("\n");
+}
+
+void wifiman_printMetrics(Print *output)
+{
+    _wifiman_printMetricHeader(output, "wifiman_scans_total", "counter", "Scans started by wifiman");
+    _wifiman_printMetric(output, "wifiman_scans_total", _wifiman_metrics.scans);
+
+    _wifiman_printMetricHeader(output, "wifiman_connect_attempts_total", "counter", "Connect attempts (incl. retries)");
+    _wifiman_printMetric(output, "wifiman_connect_attempts_total", _wifiman_metrics.connectAttempts);
+    _wifiman_printMetricHeader(output, "wifiman_connect_successes_total", "counter", "Successful connects");
+    _wifiman_printMetric(output, "wifiman_connect_successes_total", _wifiman_metrics.connectSuccesses);
+    _wifiman_printMetricHeader(output, "wifiman_retries_total", "counter", "Reconnect attempts after an error");
+    _wifiman_printMetric(output, "wifiman_retries_total", _wifiman_metrics.retries);
+
+    if (_wifiman_data != nullptr)
+    {
+        _wifiman_printMetricHeader(output, "wifiman_network_connect_attempts_total", "counter", "Connect attempts per saved network");
+        for (int i = 0; i < _wifiman_data->length; ++i)
+            _wifiman_printMetric(output, "wifiman_network_connect_attempts_total", _wifiman_data->networks[i]->connectAttempts, "ssid", _wifiman_data->networks[i]->ssid);
+        _wifiman_printMetricHeader(output, "wifiman_network_connect_successes_total", "counter", "Successful connects per saved network");
+        for (int i = 0; i < _wifiman_data->length; ++i)
+            _wifiman_printMetric(output, "wifiman_network_connect_successes_total", _wifiman_data->networks[i]->connectSuccesses, "ssid", _wifiman_data->networks[i]->ssid);
+
+        _wifiman_printMetricHeader(output, "wifiman_networks", "gauge", "Saved networks");
+        _wifiman_printMetric(output, "wifiman_networks", _wifiman_data->length);
+        _wifiman_printMetricHeader(output, "wifiman_networks_usable", "gauge", "Saved networks usable for auto connection");
+        _wifiman_printMetric(output, "wifiman_networks_usable", wifiman_countUsableNetworks(_wifiman_data));
+        _wifiman_printMetricHeader(output, "wifiman_status", "gauge", "Current WM_StatusCode");
+        _wifiman_printMetric(output, "wifiman_status", _wifiman_data->status.code);
+        size_t sharedBytes = 0;
+        _wifiman_printMetricHeader(output, "wifiman_memory_bytes", "gauge", "Heap used by the network list");
+        _wifiman_printMetric(output, "wifiman_memory_bytes", wifiman_getMemoryUsage(_wifiman_data, &sharedBytes));
+        _wifiman_printMetricHeader(output, "wifiman_memory_shared_bytes", "gauge", "Heap saved by shared passwords");
+        _wifiman_printMetric(output, "wifiman_memory_shared_bytes", sharedBytes);
+    }
+
+    _wifiman_printMetricHeader(output, "wifiman_heap_free_bytes", "gauge", "Free heap");
+    _wifiman_printMetric(output, "wifiman_heap_free_bytes", ESP.getFreeHeap());
+    _wifiman_printMetricHeader(output, "wifiman_heap_min_free_bytes", "gauge", "Lowest free heap since boot");
+    _wifiman_printMetric(output, "wifiman_heap_min_free_bytes", ESP.getMinFreeHeap());
+    _wifiman_printMetricHeader(output, "wifiman_heap_largest_free_block_bytes", "gauge", "Largest allocatable block (fragmentation)");
+    _wifiman_printMetric(output, "wifiman_heap_largest_free_block_bytes", ESP.getMaxAllocHeap());
+
+    _wifiman_printMetricHeader(output, "wifiman_time_to_connect_seconds", "histogram", "Time from connect request to GOT_IP (incl. retries)");
+    uint32_t cumulative = 0;
+    for (int i = 0; i < (int)WM_TTC_BUCKETS; ++i)
+    {
+        cumulative += _wifiman_metrics.timeToConnect[i];
+        _wifiman_printMetric(output, "wifiman_time_to_connect_seconds", cumulative, "le", _wifiman_ttcBucketNames[i], "_bucket");
+    }
+    output->print("wifiman_time_to_connect_seconds_sum ");
+    output->print(_wifiman_metrics.timeToConnectSumMs / 1000.0, 3);
+    output->print("\n");
+    _wifiman_printMetric(output, "wifiman_time_to_connect_seconds", cumulative, nullptr, nullptr, "_count");
+
+#if WM_FEATURE_DIAGNOSTICS
+    _wifiman_printMetricHeader(output, "wifiman_boot_to_connect_milliseconds", "gauge", "Uptime at the first GOT_IP (0 = not connected yet)");
+    _wifiman_printMetric(output, "wifiman_boot_to_connect_milliseconds", _wifiman_radioStats.bootToConnectMs);
+#endif
+
+#if WM_FEATURE_WORKER
+    _wifiman_printMetricHeader(output, "wifiman_worker_wakeups_total", "counter", "Worker task loop iterations");
+    _wifiman_printMetric(output, "wifiman_worker_wakeups_total", _wifiman_metrics.workerWakeups);
+    _wifiman_printMetricHeader(output, "wifiman_queue_depth", "gauge", "Commands issued, but not yet executed by the worker");
+    _wifiman_printMetric(output, "wifiman_queue_depth", ! nextConnect.handled + ! nextScan.handled + _wifiman_scheduledCommands);
+    _wifiman_printMetricHeader(output, "wifiman_worker_stack_free_bytes", "gauge", "Lowest free stack of the worker task since start");
+    _wifiman_printMetric(output, "wifiman_worker_stack_free_bytes", _wifiman_workerTaskHandle == nullptr ? 0 : uxTaskGetStackHighWaterMark(_wifiman_workerTaskHandle));
+#endif
+
+#if WM_FEATURE_WATCHDOG
+    static const char *recoveryNames[WM_RECOVERY_COUNT] = { "abort_scan", "restart_connect", "reinit_driver", "boost_worker" };
+
+    _wifiman_printMetricHeader(output, "wifiman_watchdog_recoveries_total", "counter", "Recoveries of a stuck scan, connect attempt or worker");
+    for (int i = 0; i < WM_RECOVERY_COUNT; ++i)
+        _wifiman_printMetric(output, "wifiman_watchdog_recoveries_total", _wifiman_metrics.recoveries[i], "action", recoveryNames[i]);
+#endif
+
+#if WM_FEATURE_ENERGY
+    static const char *activityNames[WM_ACTIVITY_COUNT] = { "scan_active", "scan_passive", "connect", "connected" };
+    WM_EnergyStats energy = wifiman_getEnergyStats();
+
+    _wifiman_printMetricHeader(output, "wifiman_radio_activities_total", "counter", "Started radio activities");
+    for (int i = 0; i < WM_ACTIVITY_COUNT; ++i)
+        _wifiman_printMetric(output, "wifiman_radio_activities_total", energy.count[i], "activity", activityNames[i]);
+    _wifiman_printMetricHeader(output, "wifiman_radio_seconds_total", "counter", "Radio-on time per activity");
+    for (int i = 0; i < WM_ACTIVITY_COUNT; ++i)
+    {
+        _wifiman_printMetricName(output, "wifiman_radio_seconds_total", nullptr, "activity", activityNames[i]);
+        output->print(" ");
+        output->print(energy.radioMs[i] / 1000.0, 3);
+        output->print("\n");
+    }
+    _wifiman_printMetricHeader(output, "wifiman_energy_joules_total", "counter", "Estimated energy per activity (see wifiman_setPowerModel)");
+    for (int i = 0; i < WM_ACTIVITY_COUNT; ++i)
+    {
+        _wifiman_printMetricName(output, "wifiman_energy_joules_total", nullptr, "activity", activityNames[i]);
+        output->print(" ");
+        output->print(energy.energyUJ[i] / 1000000.0, 3);
+        output->print("\n");
+    }
+    _wifiman_printMetricHeader(output, "wifiman_scans_skipped_total", "counter", "Periodic scans skipped because the energy budget was exhausted");
+    _wifiman_printMetric(output, "wifiman_scans_skipped_total", energy.scansSkipped);
+#endif
+
+#if WM_FEATURE_PERSISTENCE
+    _wifiman_printMetricHeader(output, "wifiman_flash_keys_written_total", "counter", "NVS keys written");
+    _wifiman_printMetric(output, "wifiman_flash_keys_written_total", _wifiman_storageStats.keysWritten);
+    _wifiman_printMetricHeader(output, "wifiman_flash_entries_written_total", "counter", "32 byte NVS entries written");
+    _wifiman_printMetric(output, "wifiman_flash_entries_written_total", _wifiman_storageStats.entriesWritten);
+#endif
+}
+
+bool wifiman_handleMetricsRequest(WiFiClient &client, uint16_t timeoutMs)
+{
+    // Only the request line is of interest ("GET /metrics HTTP/1.1"), but the
+    // headers up to the empty line are consumed as well: closing the socket
+    // with unread data would send a RST, which can discard the response
+    char request[16] = "";
+    uint8_t pos = 0;
+    bool requestLine = true;
+    bool emptyLine = true;
+    ArduinoTime_t start = millis();
+
+    while (millis() - start < timeoutMs)
+    {
+        int c = client.read();
+        if (c < 0)
+        {
+            if (! client.connected())
+                break;
+            delay(1);
+            continue;
+        }
+        if (c == '\r')
+            continue;
+        if (c == '\n')
+        {
+            if (emptyLine && ! requestLine)
+                break;
+            requestLine = false;
+            emptyLine = true;
+            continue;
+        }
+        if (requestLine && pos < sizeof(request) - 1)
+            request[pos++] = c;
+        emptyLine = false;
+    }
+    request[pos] = 0;
+
+    bool found = (strncmp(request, "GET /metrics", 12) == 0 && (request[12] == ' ' || request[12] == '?' || request[12] == 0));
+
+    if (found)
+    {
+        client.print("HTTP/1.1 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nConnection: close\r\n\r\n");
+        wifiman_printMetrics(&client);
+    }
+    else
+    {
+        client.print("HTTP/1.1 404 Not Found\r\nConnection: close\r\n\r\n");
+    }
+
+    client.stop();
+
+    return found;
+}
+#endif
+
+#if WM_FEATURE_TRACE
+void wifiman_setTraceEnabled(bool enabled)
+{
+    _wifiman_traceEnabled = enabled;
+}
+
+void wifiman_clearTrace()
+{
+    portENTER_CRITICAL(&_wifiman_traceMux);
+    _wifiman_traceNext = 0;
+    _wifiman_traceWrapped = false;
+    portEXIT_CRITICAL(&_wifiman_traceMux);
+}
+
+void wifiman_printTrace(Print *output)
+{
+    bool enabled = _wifiman_traceEnabled;
+    _wifiman_traceEnabled = false;
+
+    output->print("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+
+    for (int i = 0; i < (int)(sizeof(_wifiman_traceLaneNames) / sizeof(_wifiman_traceLaneNames[0])); ++i)
+    {
+        output->printf("{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"%s\"}},\n",
+                i, _wifiman_traceLaneNames[i]);
+    }
+
+    uint16_t count = (_wifiman_traceWrapped ? WM_TRACE_BUFFER_SIZE : _wifiman_traceNext);
+    uint16_t start = (_wifiman_traceWrapped ? _wifiman_traceNext : 0);
+
+    for (int i = 0; i < count; ++i)
+    {
+        const WM_TraceEvent *event = &_wifiman_traceBuffer[(start + i) % WM_TRACE_BUFFER_SIZE];
+
+        output->printf("{\"name\":\"%s\",\"ph\":\"%c\",%s\"ts\":%lu,\"pid\":1,\"tid\":%d,\"args\":{\"arg\":%d}}%s\n",
+                _wifiman_traceNames[event->type],
+                event->phase,
+                event->phase == 'i' ? "\"s\":\"t\"," : "",
+                (unsigned long)event->timeUs,
+                event->lane,
+                event->arg,
+                i + 1 < count ? "," : "");
+    }
+
+    output->print("]}\n");
+
+    _wifiman_traceEnabled = enabled;
+}
+
+static void _wifiman_trace(WM_TraceType type, char phase, uint8_t arg, uint8_t lane)
+{
+    if (! _wifiman_traceEnabled)
+        return;
+
+    if (lane == WM_TRACE_LANE_AUTO)
+    {
+        TaskHandle_t current = xTaskGetCurrentTaskHandle();
+#if WM_FEATURE_WORKER
+        if (current == _wifiman_workerTaskHandle)
+            lane = WM_TRACE_LANE_WORKER;
+        else
+#endif
+        if (current == _wifiman_eventTaskHandle)
+            lane = WM_TRACE_LANE_EVENT;
+        else
+            lane = WM_TRACE_LANE_APP;
+    }
+
+    portENTER_CRITICAL(&_wifiman_traceMux);
+    WM_TraceEvent *event = &_wifiman_traceBuffer[_wifiman_traceNext];
+    event->timeUs = micros();
+    event->type = type;
+    event->phase = phase;
+    event->lane = (WM_TraceLane)lane;
+    event->arg = arg;
+    if (++_wifiman_traceNext == WM_TRACE_BUFFER_SIZE)
+    {
+        _wifiman_traceNext = 0;
+        _wifiman_traceWrapped = true;
+    }
+    portEXIT_CRITICAL(&_wifiman_traceMux);
+}
+#endif
 
-    _wifiman_retryCount = 0;
+static void _wifiman_notifyStatus(WM_SharedData *data)
+{
+    _wifiman_publishStatus(data);
 
-    data->status.code = CONNECTING;
-    data->status.targetNetwork = bestIndex;
     if (_wifiman_statusCallback != nullptr)
+    {
+        WM_TRACE_SCOPE(WM_TRACE_STATUS_CALLBACK, data->status.code);
         _wifiman_statusCallback(&data->status);
+    }
 
-    return WMRT_SUCCESS;
+#if WM_FEATURE_WAITERS
+    WM_Status status = data->status;
+    _wifiman_fireWaiters(WM_WAIT_STATUS, &status);
+#endif
 }
 
-void wifiman_print(WM_SharedData *data, HardwareSerial *output)
+static void _wifiman_publishStatus(WM_SharedData *data)
 {
-    if (data == nullptr)
-    {
-        output->print("wifiman_print: data ptr is NULL!\n");
+    if (data != _wifiman_data)
         return;
-    }
 
-    output->printf("--- WM_SharedData @ %p ---\n", data);
-    output->printf("Network list: %d of %d set @ %p\n", data->length, data->capacity, data->networks);
-    output->print("[#] SSID --- Password --- State\n");
-    for (int i = 0; i < data->length; ++i)
-    {
-        output->printf("[%d] %s --- %s --- %d @ %p\n", 
-                i, 
-                data->networks[i]->ssid, 
-                data->networks[i]->pass == nullptr ? "[none]" : data->networks[i]->pass, 
-                data->networks[i]->state, 
-                data->networks[i]);
-    }
-    output->printf("[%d] %p\n", data->length, data->networks[data->length]);
+    ++data->status.generation;
+
+    _WM_StatusWord published;
+    published.status = data->status;
+    __atomic_store_n(&_wifiman_statusWord, published.word, __ATOMIC_RELEASE);
 }
 
-WM_ReturnCode wifiman_getDisplayFilterByScan(WM_WifiNetworkDisplay networks[], uint8_t count)
+static WM_WifiNetwork* _wifiman_allocNetwork()
 {
-    assert(networks != nullptr);
+    WM_WifiNetwork *result = (WM_WifiNetwork*)malloc(sizeof(WM_WifiNetwork));
+    *result = WM_WifiNetwork();
+    return result;
+}
 
-    if (count == 0)
-        return WMRT_SUCCESS;
+static void _wifiman_freeNetwork(WM_WifiNetwork *network)
+{
+    if (WM_OWNS_SSID(network))
+        free(network->ssid);
+    if (WM_OWNS_PASS(network))
+        _wifiman_releasePass(network->pass);
+    free(network);
+}
 
-    auto scanResult = WiFi.scanComplete();
+static void _wifiman_setPass(WM_SharedData *data, WM_WifiNetwork *network, const char *pass)
+{
+    if (WM_OWNS_PASS(network))
+        _wifiman_releasePass(network->pass);
+#if WM_FEATURE_FACTORY_TABLE
+    network->constPass = false;
+#endif
 
-    switch (scanResult)
-    {
-        case -2: // NOT STARTED 
-        case -1: // RUNNING
-            return WMRT_SCAN_NOT_READY;
-        case 0: // NO NETWORK IN RANGE
-            return WMRT_NETWORK_NOT_IN_LIST;
-    }
+    network->pass = nullptr;
+    network->pass = _wifiman_internPass(data, pass);
+}
 
-    if (count < scanResult)
-        return WMRT_SIZE_MISMATCH;
+// Site lists often use one password for many networks, so equal passwords
+// share one allocation. The reference count is stored in front of the string.
+static char* _wifiman_internPass(WM_SharedData *data, const char *pass)
+{
+    if (pass == nullptr)
+        return nullptr;
 
-    for (int i = 0; i < scanResult; ++i)
+    for (int i = 0; i < data->length; ++i)
     {
-        networks[i].scanIndex = i;
-        networks[i].networkIndex = wifiman_findNetworkInList(_wifiman_data, WiFi.SSID(i).c_str());
+        char *existing = data->networks[i]->pass;
+        if (existing == nullptr || ! WM_OWNS_PASS(data->networks[i]) || strcmp(existing, pass) != 0)
+            continue;
+
+        uint8_t *refs = (uint8_t*)existing - 1;
+        if (*refs == UINT8_MAX)
+            break;
+
+        ++(*refs);
+        return existing;
     }
 
-    return WMRT_SUCCESS;
+    size_t length = strlen(pass);
+    uint8_t *block = (uint8_t*)malloc(length + 2);
+    block[0] = 1;
+    memcpy(block + 1, pass, length + 1);
+
+    return (char*)(block + 1);
 }
 
-WM_ReturnCode wifiman_getDisplayFilterBySaved(WM_WifiNetworkDisplay networks[], uint8_t count,
-        WM_WifiNetworkDisplay scanFilter[], uint8_t scanCount)
+static void _wifiman_releasePass(char *pass)
 {
-    assert(networks != nullptr);
+    if (pass == nullptr)
+        return;
 
-    if (count == 0)
-        return WMRT_SUCCESS;
-    if (count < _wifiman_data->length)
-        return WMRT_SIZE_MISMATCH;
+    uint8_t *refs = (uint8_t*)pass - 1;
+    if (--(*refs) == 0)
+        free(refs);
+}
 
-    for (int i = 0; i < _wifiman_data->length; ++i)
-    {
-        networks[i].networkIndex = i;
-        networks[i].scanIndex = -1;
-    }
+static void _wifiman_setState(WM_SharedData *data, uint8_t index, WM_NetworkWorkingState state)
+{
+    if (data->networks[index]->state != state)
+        _wifiman_markDirty(data, index);
 
-    auto scanResult = WiFi.scanComplete();
+    data->networks[index]->state = state;
+    _wifiman_setBit(&data->usable, index, state != NETWORK_FAILED_BEFORE);
+    _wifiman_setBit(&data->failed, index, state == NETWORK_FAILED_BEFORE);
+}
 
-    if (scanFilter == nullptr && scanResult <= 0)
-        return WMRT_SUCCESS;
+static void _wifiman_setUplink(WM_SharedData *data, uint8_t index, WM_UplinkState uplink)
+{
+    data->networks[index]->uplink = uplink;
+    _wifiman_setBit(&data->offline, index, uplink == UPLINK_OFFLINE);
+}
 
-    if (scanFilter != nullptr)
-    {
-        for (int i = 0; i < scanCount; ++i)
-        {
-            if (scanFilter[i].networkIndex < count)
-                networks[scanFilter[i].networkIndex].scanIndex = scanFilter[i].scanIndex;
-        }
-    }
-    else
+// Recalculate all network sets (and the sorted index) from scratch (after the
+// list was changed externally)
+static void _wifiman_rebuildSets(WM_SharedData *data)
+{
+#if WM_FEATURE_SORTED_INDEX
+    _wifiman_rebuildIndex(data);
+#endif
+
+    memset(&data->usable, 0, sizeof(data->usable));
+    memset(&data->failed, 0, sizeof(data->failed));
+    memset(&data->offline, 0, sizeof(data->offline));
+    memset(&data->inRange, 0, sizeof(data->inRange));
+    _wifiman_scanMapValid = false;
+
+    for (int i = 0; i < data->length; ++i)
     {
-        for (int i = 0; i < scanResult; ++i)
-        {
-            uint8_t found = wifiman_findNetworkInList(_wifiman_data, WiFi.SSID(i).c_str());
-            if (found < count)
-                networks[found].scanIndex = i;
-        }
+        _wifiman_setState(data, i, data->networks[i]->state);
+        _wifiman_setUplink(data, i, data->networks[i]->uplink);
     }
-
-    return WMRT_SUCCESS;
 }
 
-static void _wifiman_checkConnection()
+#if WM_FEATURE_SORTED_INDEX
+// Binary search in the sorted index: first position whose SSID compares
+// greater or equal to key (greater with upper). With a prefixLength only
+// that many characters are compared. Call with _wifiman_indexMux held.
+static uint8_t _wifiman_searchSorted(WM_SharedData *data, const char *key, size_t prefixLength, bool upper)
 {
-    if (WiFi.status() == WL_CONNECTED)
-    {
-        Serial.print("[WIFIMAN] Checking connection...already connected\n");
-        return;
-    }
-    if (wifiman_countUsableNetworks(_wifiman_data) == 0)
-    {
-        Serial.print("[WIFIMAN] Checking connection...no usable networks\n");
-        return;
-    }
+    uint8_t low = 0;
+    uint8_t high = data->length;
 
-    Serial.print("[WIFIMAN] Checking connection...trying to connect\n");
-    int8_t status = wifiman_connectToBestWifi(_wifiman_data);
+    while (low < high)
+    {
+        uint8_t mid = low + (high - low) / 2;
+        const char *ssid = data->networks[data->sorted[mid]]->ssid;
+        int result = (prefixLength == 0 ? strcasecmp(ssid, key) : strncasecmp(ssid, key, prefixLength));
 
-    Serial.printf("[WIFIMAN] connect to best wifi returned: %d\n", status);
+        if (result < 0 || (upper && result == 0))
+            low = mid + 1;
+        else
+            high = mid;
+    }
 
-    // Turn on periodic background scans, if no saved network is in range
-    // so we connect as soon, as a suitable network moves into range
-    if (status == WMRT_NETWORK_NOT_IN_LIST)
-        _wifiman_scanResume();
-    else
-        _wifiman_scanPause();
+    return low;
 }
 
-static void _wifiman_wifiConnectedEvent(arduino_event_t *event)
+// Insertion sort of the first length networks into sorted, the list is small
+// and often (factory table) sorted already
+static void _wifiman_sortIndex(WM_SharedData *data, uint8_t length, uint8_t *sorted)
 {
-    Serial.printf("[WIFIMAN] Connected to \"%.*s\" after %d attempts\n", 
-        event->event_info.wifi_sta_connected.ssid_len,
-        (char*)(event->event_info.wifi_sta_connected.ssid), 
-        _wifiman_retryCount + 1);
-
-    uint8_t index = wifiman_findNetworkInList(_wifiman_data, event->event_info.wifi_sta_connected.ssid, event->event_info.wifi_sta_connected.ssid_len);
-    
-    _wifiman_data->status.code = CONNECTED;
-    _wifiman_data->status.targetNetwork = index;
-    _wifiman_data->status.connectAttempts = _wifiman_retryCount + 1;
-    if (_wifiman_statusCallback != nullptr)
-        _wifiman_statusCallback(&_wifiman_data->status);
-    
-    if (index >= _wifiman_data->length)
-        return;
+    for (int i = 0; i < length; ++i)
+    {
+        uint8_t index = i;
+        int j = i;
+        for (; j > 0 && strcasecmp(data->networks[sorted[j - 1]]->ssid, data->networks[index]->ssid) > 0; --j)
+            sorted[j] = sorted[j - 1];
 
-    _wifiman_retryCount = 0;
+        sorted[j] = index;
+    }
+}
 
-    _wifiman_data->networks[index]->state = NETWORK_WORKED_BEFORE;
+// Sorted aside, lookups never see a half sorted index
+static void _wifiman_rebuildIndex(WM_SharedData *data)
+{
+    uint8_t sorted[UINT8_MAX];
+    _wifiman_sortIndex(data, data->length, sorted);
 
-    if (_wifiman_autoConnect)
-        _wifiman_scanPause();
+    portENTER_CRITICAL(&_wifiman_indexMux);
+    memcpy(data->sorted, sorted, data->length);
+    portEXIT_CRITICAL(&_wifiman_indexMux);
 }
+#endif
 
-static void _wifiman_wifiDisconnectedEvent(arduino_event_t *event)
+// Look up the network index of all scan results and update data->inRange
+// This is only done once per scan result (unless the list changes)
+// Returns false if no scan result is available (or we ran out of memory)
+static bool _wifiman_updateScanMap(WM_SharedData *data)
 {
-    Serial.printf("[WIFIMAN] Disconnected from \"%.*s\", reason: %d\n", 
-        event->event_info.wifi_sta_disconnected.ssid_len,
-        (char*)(event->event_info.wifi_sta_disconnected.ssid), 
-        event->event_info.wifi_sta_disconnected.reason);
+    if (data == nullptr || data != _wifiman_data)
+        return false;
 
-    uint8_t index = wifiman_findNetworkInList(_wifiman_data, event->event_info.wifi_sta_disconnected.ssid, event->event_info.wifi_sta_disconnected.ssid_len);
+    WM_SCAN_LOCK();
 
-    // https://espressif-docs.readthedocs-hosted.com/projects/espressif-esp-faq/en/latest/software-framework/wifi.html#connect-while-esp32-connecting-wi-fi-how-can-i-determine-the-reason-of-failure-by-error-codes
-    // https://github.com/espressif/esp-idf/issues/3349#issuecomment-485764274
-    // https://docs.espressif.com/projects/esp-idf/en/latest/esp32/api-guides/wifi.html#wi-fi-reason-code
-    switch (event->event_info.wifi_sta_disconnected.reason)
+    // Without scan done handler we cannot tell if the result changed
+#if WM_FEATURE_AUTOCONNECT
+    if (_wifiman_scanMapValid && _wifiman_scanMapGeneration == _wifiman_scanGeneration)
+        return true;
+#endif
+
+    int16_t scanResult = WiFi.scanComplete();
+    if (scanResult < 0)
+        return false;
+    if (scanResult > UINT8_MAX)
+        scanResult = UINT8_MAX;
+
+    if (scanResult > _wifiman_scanMapSize)
     {
-        case WIFI_REASON_ASSOC_LEAVE: // after calling WiFi.disconnect()
-        case WIFI_REASON_AUTH_LEAVE:  // network was shut down
-            _wifiman_data->status.code = DISCONNECTED;
-            break;
-        case WIFI_REASON_NO_AP_FOUND: // SSID not found
-            _wifiman_data->status.code = NETWORK_NOT_FOUND;
-            break;
-        case WIFI_REASON_4WAY_HANDSHAKE_TIMEOUT: // wrong password
-        case WIFI_REASON_HANDSHAKE_TIMEOUT: // wrong password (less common)
-        case WIFI_REASON_AUTH_FAIL: // generic fail (happens sometimes, hard to pin down)
-        case WIFI_REASON_AUTH_EXPIRE: // i.e. when reconnecting to phone hotspot with phone on standby
-        default:
-            if (index < _wifiman_data->length && _wifiman_retryCount >= _wifiman_maxRetries)
-                _wifiman_data->networks[index]->state = NETWORK_FAILED_BEFORE;
-            _wifiman_data->status.code = CONNECTION_FAILED;
-            break;
+        uint8_t *temp = (uint8_t*)realloc(_wifiman_scanMap, scanResult);
+        if (temp == nullptr)
+            return false;
+        _wifiman_scanMap = temp;
+
+        temp = (uint8_t*)realloc(_wifiman_scanGroupOf, scanResult);
+        if (temp == nullptr)
+            return false;
+        _wifiman_scanGroupOf = temp;
+
+        WM_ScanGroup *groups = (WM_ScanGroup*)realloc(_wifiman_scanGroups, sizeof(WM_ScanGroup) * scanResult);
+        if (groups == nullptr)
+            return false;
+        _wifiman_scanGroups = groups;
+
+        _wifiman_scanMapSize = scanResult;
     }
-    
-    _wifiman_data->status.targetNetwork = index;
-    _wifiman_data->status.disconnectReason = event->event_info.wifi_sta_disconnected.reason;
 
-    if (index < _wifiman_data->length && 
-            _wifiman_retryCount < _wifiman_maxRetries && 
-            event->event_info.wifi_sta_disconnected.reason != WIFI_REASON_ASSOC_LEAVE)
+    memset(&data->inRange, 0, sizeof(data->inRange));
+    _wifiman_scanGroupCount = 0;
+
+    for (int i = 0; i < scanResult; ++i)
     {
-        Serial.printf("[WIFIMAN] Attempting to reconnect to %s (attempt #%d)\n", (char*)(event->event_info.wifi_sta_disconnected.ssid), _wifiman_retryCount + 1);
+        wifi_ap_record_t *record = (wifi_ap_record_t*)WiFi.getScanInfoByIndex(i);
+        _wifiman_scanMap[i] = (record == nullptr ? -1 : wifiman_findNetworkInList(data, (const char*)record->ssid));
+        _wifiman_scanGroupOf[i] = -1;
 
-        // connect after 1 - 2 - 4 - 8 - ... seconds
-        _wifiman_connect(index, false, _wifiman_retryCount >= 3 ? 8000 : 1000 * (1 << _wifiman_retryCount));
+        if (record == nullptr)
+            continue;
 
-        ++_wifiman_retryCount;
+        // Saved networks are grouped by index, others by SSID (hidden
+        // networks without SSID stay separate)
+        WM_ScanGroup *group = nullptr;
+        for (int g = 0; g < _wifiman_scanGroupCount && group == nullptr; ++g)
+        {
+            if (_wifiman_scanMap[i] != (uint8_t)-1 || _wifiman_scanGroups[g].networkIndex != (uint8_t)-1)
+            {
+                if (_wifiman_scanGroups[g].networkIndex == _wifiman_scanMap[i])
+                    group = &_wifiman_scanGroups[g];
+            }
+            else if (record->ssid[0] != 0 && strcmp(_wifiman_scanSSID(_wifiman_scanGroups[g].scanIndex), (const char*)record->ssid) == 0)
+            {
+                group = &_wifiman_scanGroups[g];
+            }
+        }
+
+        if (group == nullptr)
+        {
+            group = &_wifiman_scanGroups[_wifiman_scanGroupCount++];
+            *group = WM_ScanGroup();
+            group->scanIndex = i;
+            group->networkIndex = _wifiman_scanMap[i];
+        }
+        else if (record->rssi > WiFi.RSSI(group->scanIndex))
+        {
+            group->scanIndex = i;
+        }
+
+        ++(group->bssidCount);
+        group->channels |= (1u << (record->primary & 0x0F));
+        if (record->authmode > group->authMode)
+            group->authMode = record->authmode;
+        _wifiman_scanGroupOf[i] = group - _wifiman_scanGroups;
     }
-    else 
+
+    for (int g = 0; g < _wifiman_scanGroupCount; ++g)
     {
-        if (_wifiman_statusCallback != nullptr)
-            _wifiman_statusCallback(&_wifiman_data->status);
+        uint8_t index = _wifiman_scanGroups[g].networkIndex;
+        if (index >= data->length)
+            continue;
 
-        if (_wifiman_autoConnect && event->event_info.wifi_sta_disconnected.reason != WIFI_REASON_ASSOC_LEAVE)
-            _wifiman_checkConnection();
+        _wifiman_setBit(&data->inRange, index, true);
+        data->networks[index]->channel = ((wifi_ap_record_t*)WiFi.getScanInfoByIndex(_wifiman_scanGroups[g].scanIndex))->primary;
     }
-}
-
-static void _wifiman_wifiScanDoneEvent(arduino_event_t *event)
-{
-    Serial.printf("[WIFIMAN] Scan done! Networks found: %d, scan id %d, status %d\n", event->event_info.wifi_scan_done.number, event->event_info.wifi_scan_done.scan_id, event->event_info.wifi_scan_done.status);
 
-    _wifiman_scanTime = millis();
+    _wifiman_scanMapLength = scanResult;
+    _wifiman_scanMapGeneration = _wifiman_scanGeneration;
+    _wifiman_scanMapValid = true;
 
-    _wifiman_checkConnection();
+    return true;
 }
 
-static void _wifiman_scanResume()
+static inline void _wifiman_markDirty(WM_SharedData *data, uint8_t index)
 {
-    Serial.print("[WIFIMAN] Resuming wifi scan thread\n");
-    xTaskNotify(_wifiman_workerTaskHandle, 1, eSetValueWithOverwrite);
+#if WM_FEATURE_PERSISTENCE
+    _wifiman_setBit(&data->dirty, index, true);
+#endif
 }
 
-static void _wifiman_scanPause()
+static inline void _wifiman_setBit(WM_NetworkSet *set, uint8_t index, bool value)
 {
-    Serial.print("[WIFIMAN] Pausing wifi scan thread\n");
-    xTaskNotify(_wifiman_workerTaskHandle, 0, eSetValueWithOverwrite);
+    if (value)
+        set->bits[index / 32] |= (1ul << (index % 32));
+    else
+        set->bits[index / 32] &= ~(1ul << (index % 32));
 }
 
-static void _wifiman_doScan(ArduinoTime_t delay)
+static inline bool _wifiman_testBit(const WM_NetworkSet *set, uint8_t index)
 {
-    Serial.printf("[WIFIMAN] Issuing scan command: %lu...\n", delay);
-
-    xSemaphoreTake(nextScan.lock, portMAX_DELAY);
-
-    nextScan.execTime = millis() + delay;
-    nextScan.handled = false;
-
-    xSemaphoreGive(nextScan.lock);
+    return (set->bits[index / 32] & (1ul << (index % 32))) != 0;
 }
 
-static void _wifiman_connect(uint8_t index, bool byUser, ArduinoTime_t delay)
+// Remove bit at index and shift all following bits down by one
+// (same as the network list on delete)
+static void _wifiman_removeBit(WM_NetworkSet *set, uint8_t index)
 {
-    Serial.printf("[WIFIMAN] Issuing connect command: %d, %d, %lu...\n", index, byUser, delay);
-
-    xSemaphoreTake(nextConnect.lock, portMAX_DELAY);
+    uint8_t word = index / 32;
+    uint32_t lowMask = (1ul << (index % 32)) - 1;
 
-    nextConnect.execTime = millis() + delay;
-    nextConnect.networkIndex = index;
-    nextConnect.issuedByUser = byUser;
-    nextConnect.handled = false;
+    set->bits[word] = (set->bits[word] & lowMask) | ((set->bits[word] >> 1) & ~lowMask);
 
-    xSemaphoreGive(nextConnect.lock);
+    for (int i = word; i < 7; ++i)
+    {
+        set->bits[i] |= (set->bits[i + 1] & 1ul) << 31;
+        set->bits[i + 1] >>= 1;
+    }
 }
 
+#if WM_FEATURE_WORKER
 static void _wifiman_workerTask(void *parameters)
 {
-    Serial.print("[WIFIMAN-THREAD] worker task: started.\n");
+    WM_LOG("[WIFIMAN-THREAD] worker task: started.\n");
+
+#if WM_FEATURE_PERSISTENCE && WM_FEATURE_AUTOCONNECT
+    if (_wifiman_bootLoad)
+    {
+        _wifiman_bootLoad = false;
+        _wifiman_bootLoadList();
+    }
+#endif
 
     uint32_t notifyValue;
     _WM_WifiConnect connect;
     _WM_WifiScan scan;
+#if WM_FEATURE_UPLINK_PROBE
+    _WM_UplinkProbe probe;
+#endif
 
     while (true)
     {
@@ -762,49 +3937,86 @@ static void _wifiman_workerTask(void *parameters)
         // so we reduce the amount of locks and unlocks done
         if (! nextConnect.handled)
         {
-            Serial.print("[WIFIMAN-THREAD] Getting new connect cmd...\n");
+            WM_LOG("[WIFIMAN-THREAD] Getting new connect cmd...\n");
 
+            WM_TRACE(WM_TRACE_WAIT_CONNECT_LOCK, 'B', 0);
             xSemaphoreTake(nextConnect.lock, portMAX_DELAY);
+            WM_TRACE(WM_TRACE_WAIT_CONNECT_LOCK, 'E', 0);
             // Do not let automatic reconnects (not issued by user) overwrite
             // manual connect orders by user
             if (nextConnect.issuedByUser || connect.handled || ! connect.issuedByUser)
             {
                 connect = nextConnect;
                 nextConnect.handled = true;
+                WM_TRACE(WM_TRACE_CONNECT_PICKED_UP, 'i', connect.networkIndex);
             }
             xSemaphoreGive(nextConnect.lock);
         }
 
         if (! nextScan.handled)
         {
-            Serial.print("[WIFIMAN-THREAD] Getting new scan cmd...\n");
+            WM_LOG("[WIFIMAN-THREAD] Getting new scan cmd...\n");
 
+            WM_TRACE(WM_TRACE_WAIT_SCAN_LOCK, 'B', 0);
             xSemaphoreTake(nextScan.lock, portMAX_DELAY);
+            WM_TRACE(WM_TRACE_WAIT_SCAN_LOCK, 'E', 0);
             scan = nextScan;
             nextScan.handled = true;
             xSemaphoreGive(nextScan.lock);
+            WM_TRACE(WM_TRACE_SCAN_PICKED_UP, 'i', 0);
         }
 
+#if WM_FEATURE_UPLINK_PROBE
+        if (! nextProbe.handled)
+        {
+            probe = nextProbe;
+            nextProbe.handled = true;
+        }
+#endif
+
         xTaskNotifyWait(0, 0, &notifyValue, 0);
+        WM_METRIC_INC(workerWakeups);
+
+#if WM_FEATURE_WATCHDOG
+        __atomic_store_n(&_wifiman_workerHeartbeat, millis(), __ATOMIC_RELEASE);
+        if (__atomic_exchange_n(&_wifiman_workerBoosted, false, __ATOMIC_ACQ_REL))
+            vTaskPrioritySet(nullptr, WM_WORKER_PRIORITY);
+
+        if (millis() - _wifiman_watchdogCheckTime >= WM_WATCHDOG_CHECK_MS)
+        {
+            _wifiman_watchdogCheckTime = millis();
+            _wifiman_watchdogCheck();
+        }
+#endif
 
         if (! connect.handled && _time_now_or_passed(connect.execTime, millis()))
         {
-            Serial.printf("[WIFIMAN-THREAD] connecting to network: %s...\n", _wifiman_data->networks[connect.networkIndex]->ssid);
+            WM_LOG("[WIFIMAN-THREAD] connecting to network: %s...\n", _wifiman_data->networks[connect.networkIndex]->ssid);
 
-            WiFi.disconnect();
-            WiFi.begin(_wifiman_data->networks[connect.networkIndex]->ssid, 
-                    _wifiman_data->networks[connect.networkIndex]->pass);
+            _wifiman_beginConnect(connect.networkIndex);
             connect.handled = true;
         }
 
         if ((! scan.handled || notifyValue != 0) && _time_now_or_passed(scan.execTime, millis()))
         {
-            Serial.printf("[WIFIMAN-THREAD] doing %sWiFi scan...\n", notifyValue != 0 ? "PERIODIC " : "");
-
-            if (WiFi.scanComplete() != WIFI_SCAN_RUNNING)
+#if WM_FEATURE_ENERGY
+            // Only periodic scans are limited by the energy budget
+            if (scan.handled && _wifiman_scanBudgetExhausted())
+            {
+                WM_LOG("[WIFIMAN-THREAD] skipping PERIODIC WiFi scan, energy budget exhausted\n");
+                ++_wifiman_energyStats.scansSkipped;
+            }
+            else
+#endif
             {
-                WiFi.scanDelete();
-                WiFi.scanNetworks(true);
+                WM_LOG("[WIFIMAN-THREAD] doing %sWiFi scan...\n", notifyValue != 0 ? "PERIODIC " : "");
+
+#if WM_FEATURE_FAST_SCAN
+                // periodic scans look for saved networks coming into range
+                if (scan.handled)
+                    _wifiman_sweepRequested = _wifiman_fastScan;
+#endif
+                _wifiman_startScan();
             }
 
             if (notifyValue != 0)
@@ -813,11 +4025,32 @@ static void _wifiman_workerTask(void *parameters)
             scan.handled = true;
         }
 
+#if WM_FEATURE_UPLINK_PROBE
+        // A new connect command would invalidate the probe anyway
+        if (! probe.handled && connect.handled)
+        {
+            WM_SET_RADIO_FLAG(WM_RADIO_PROBING, true);
+            _wifiman_runUplinkProbe(probe.networkIndex);
+            WM_SET_RADIO_FLAG(WM_RADIO_PROBING, false);
+            probe.handled = true;
+        }
+#endif
+
+#if WM_FEATURE_PMK_CACHE
+        // Takes a while, so only when there is nothing else to do
+        if (_wifiman_pmkPending != (uint8_t)-1 && connect.handled && scan.handled)
+            _wifiman_derivePMK(__atomic_exchange_n(&_wifiman_pmkPending, (uint8_t)-1, __ATOMIC_ACQ_REL));
+#endif
+
+#if WM_FEATURE_METRICS
+        _wifiman_scheduledCommands = ! connect.handled + ! scan.handled;
+#endif
+
 #ifdef _DEBUG
         static unsigned long printTime = -300000;
         if (millis() - printTime > 300000)
         {
-            Serial.printf("[WIFIMAN-THREAD] thread watermark: %d\n", uxTaskGetStackHighWaterMark(NULL));
+            WM_LOG("[WIFIMAN-THREAD] thread watermark: %d\n", uxTaskGetStackHighWaterMark(NULL));
             printTime = millis();
         }
 #endif
@@ -825,10 +4058,11 @@ static void _wifiman_workerTask(void *parameters)
         delay(1);
     }
 
-    Serial.print("[WIFIMAN-THREAD] connectivity task: stopping.\n");
+    WM_LOG("[WIFIMAN-THREAD] connectivity task: stopping.\n");
 
     vTaskDelete(nullptr);
 }
+#endif
 
 // https://arduino.stackexchange.com/questions/12587/how-can-i-handle-the-millis-rollover
 static inline bool _time_now_or_passed(ArduinoTime_t timeToTest, ArduinoTime_t now)
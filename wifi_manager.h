@@ -5,7 +5,126 @@
 #include <stddef.h>
 #include <WiFi.h>
 
+// Compile time feature switches
+// Set a feature to 0 in your build flags (e.g. -DWM_FEATURE_DISPLAY_FILTER=0) to
+// remove the respective subsystem completely and save flash and RAM.
+// The defines need to be the same for all files including this header!
+//
+// WM_FEATURE_AUTOCONNECT: autoConnect option of wifiman_start, periodic background
+//      scans and the scan done handler (requires WM_FEATURE_WORKER)
+// WM_FEATURE_DISPLAY_FILTER: wifiman_getDisplayFilterByScan/BySaved and the
+//      visitors wifiman_visitScan/visitSaved
+// WM_FEATURE_PERSISTENCE: wifiman_readFromEEPROM/saveToEEPROM
+// WM_FEATURE_DIAGNOSTICS: wifiman_print and all log output to Serial
+// WM_FEATURE_WORKER: background task executing connect and scan commands. Without
+//      it commands are executed right away in the calling context and reconnects
+//      are done without backoff.
+// WM_FEATURE_UPLINK_PROBE: wifiman_setUplinkProbe (requires WM_FEATURE_WORKER)
+// WM_FEATURE_METRICS: counters and histograms, exported in Prometheus text format
+// WM_FEATURE_ENERGY: radio-on time and estimated energy per activity, optional
+//      energy budget for background scans
+// WM_FEATURE_POWER_SAVE: modem power save managed by wifiman (wifiman_setPowerSave)
+// WM_FEATURE_SORTED_INDEX: networks ordered by SSID for binary search lookups
+//      and prefix/range queries (wifiman_findNetworksByPrefix)
+// WM_FEATURE_FACTORY_TABLE: read-only network table compiled into the firmware
+//      (wifiman_loadFactoryNetworks, generated by tools/wifiman_factory.py)
+// WM_FEATURE_PARTITION_TABLE: factory network table in its own data partition,
+//      memory mapped (wifiman_loadPartitionNetworks, requires
+//      WM_FEATURE_FACTORY_TABLE, off by default)
+// WM_FEATURE_FAST_SCAN: channel ordered scans with early exit (wifiman_setFastScan,
+//      requires WM_FEATURE_AUTOCONNECT)
+// WM_FEATURE_ROAMING: 802.11k neighbor reports guide the channel sweep, 802.11v
+//      BSS transition requests are honored (requires WM_FEATURE_FAST_SCAN and
+//      an IDF build with CONFIG_WPA_11KV_SUPPORT, off by default)
+// WM_FEATURE_PMK_CACHE: derive the PMK of WPA/WPA2-PSK networks once (in the
+//      worker) and reconnect with it, cached in RTC memory across deep sleep
+//      (requires WM_FEATURE_WORKER)
+// WM_FEATURE_WATCHDOG: detects a stuck scan, connect attempt or worker and
+//      recovers without a power cycle (requires WM_FEATURE_WORKER)
+// WM_FEATURE_WAITERS: one-shot completion hooks (wifiman_addWaiter), used by the
+//      C++20 coroutine wrappers in wifi_manager_coro.h
+// WM_FEATURE_TRACE: record commands, events, callbacks and lock waits in a ring
+//      buffer for export in Chrome trace format (off by default)
+#ifndef WM_FEATURE_AUTOCONNECT
+#define WM_FEATURE_AUTOCONNECT 1
+#endif
+#ifndef WM_FEATURE_DISPLAY_FILTER
+#define WM_FEATURE_DISPLAY_FILTER 1
+#endif
+#ifndef WM_FEATURE_PERSISTENCE
+#define WM_FEATURE_PERSISTENCE 1
+#endif
+#ifndef WM_FEATURE_DIAGNOSTICS
+#define WM_FEATURE_DIAGNOSTICS 1
+#endif
+#ifndef WM_FEATURE_WORKER
+#define WM_FEATURE_WORKER 1
+#endif
+#ifndef WM_FEATURE_UPLINK_PROBE
+#define WM_FEATURE_UPLINK_PROBE 1
+#endif
+#ifndef WM_FEATURE_METRICS
+#define WM_FEATURE_METRICS 1
+#endif
+#ifndef WM_FEATURE_ENERGY
+#define WM_FEATURE_ENERGY 1
+#endif
+#ifndef WM_FEATURE_POWER_SAVE
+#define WM_FEATURE_POWER_SAVE 1
+#endif
+#ifndef WM_FEATURE_SORTED_INDEX
+#define WM_FEATURE_SORTED_INDEX 1
+#endif
+#ifndef WM_FEATURE_FACTORY_TABLE
+#define WM_FEATURE_FACTORY_TABLE 1
+#endif
+#ifndef WM_FEATURE_PARTITION_TABLE
+#define WM_FEATURE_PARTITION_TABLE 0
+#endif
+#ifndef WM_FEATURE_FAST_SCAN
+#define WM_FEATURE_FAST_SCAN 1
+#endif
+#ifndef WM_FEATURE_ROAMING
+#define WM_FEATURE_ROAMING 0
+#endif
+#ifndef WM_FEATURE_PMK_CACHE
+#define WM_FEATURE_PMK_CACHE 1
+#endif
+#ifndef WM_FEATURE_WATCHDOG
+#define WM_FEATURE_WATCHDOG 1
+#endif
+#ifndef WM_FEATURE_WAITERS
+#define WM_FEATURE_WAITERS 1
+#endif
+#ifndef WM_FEATURE_TRACE
+#define WM_FEATURE_TRACE 0
+#endif
+
+#if WM_FEATURE_AUTOCONNECT && ! WM_FEATURE_WORKER
+#error "wifiman: WM_FEATURE_AUTOCONNECT requires WM_FEATURE_WORKER"
+#endif
+#if WM_FEATURE_UPLINK_PROBE && ! WM_FEATURE_WORKER
+#error "wifiman: WM_FEATURE_UPLINK_PROBE requires WM_FEATURE_WORKER"
+#endif
+#if WM_FEATURE_FAST_SCAN && ! WM_FEATURE_AUTOCONNECT
+#error "wifiman: WM_FEATURE_FAST_SCAN requires WM_FEATURE_AUTOCONNECT"
+#endif
+#if WM_FEATURE_PMK_CACHE && ! WM_FEATURE_WORKER
+#error "wifiman: WM_FEATURE_PMK_CACHE requires WM_FEATURE_WORKER"
+#endif
+#if WM_FEATURE_WATCHDOG && ! WM_FEATURE_WORKER
+#error "wifiman: WM_FEATURE_WATCHDOG requires WM_FEATURE_WORKER"
+#endif
+#if WM_FEATURE_ROAMING && ! WM_FEATURE_FAST_SCAN
+#error "wifiman: WM_FEATURE_ROAMING requires WM_FEATURE_FAST_SCAN"
+#endif
+#if WM_FEATURE_PARTITION_TABLE && ! WM_FEATURE_FACTORY_TABLE
+#error "wifiman: WM_FEATURE_PARTITION_TABLE requires WM_FEATURE_FACTORY_TABLE"
+#endif
+
+#if WM_FEATURE_DIAGNOSTICS
 class HardwareSerial;
+#endif
 
 typedef enum WM_NetworkWorkingState : int8_t {
     NETWORK_STATE_UNKNOWN = -1,
@@ -13,21 +132,79 @@ typedef enum WM_NetworkWorkingState : int8_t {
     NETWORK_WORKED_BEFORE = 1
 } WM_NetworkWorkingState;
 
+// Result of the last uplink probe done on a network (see wifiman_setUplinkProbe)
+// This is runtime info only and not saved to eeprom
+typedef enum WM_UplinkState : int8_t {
+    UPLINK_STATE_UNKNOWN = -1,
+    UPLINK_OFFLINE = 0, // probe failed (no internet, captive portal, ...)
+    UPLINK_ONLINE = 1
+} WM_UplinkState;
+
 typedef struct WM_WifiNetwork {
     char *ssid = nullptr;
+    // Shared by all entries with the same password (reference counted), only
+    // change it through wifiman_addOrUpdateNetwork, never free or write to it
     char *pass = nullptr;
     WM_NetworkWorkingState state = NETWORK_STATE_UNKNOWN;
+    WM_UplinkState uplink = UPLINK_STATE_UNKNOWN;
+    uint16_t uplinkRTT = 0; // ms, only valid if uplink is UPLINK_ONLINE
+    uint8_t channel = 0; // seen on in the latest scan or connection (0 = unknown, not saved)
+#if WM_FEATURE_ROAMING
+    uint16_t neighborChannels = 0; // of the latest 802.11k neighbor report (bit per channel, not saved)
+#endif
+#if WM_FEATURE_FACTORY_TABLE
+    uint8_t factoryIndex = -1; // entry of the factory table (-1 = user network)
+    bool constPass = false; // pass points into the factory table (not allocated)
+#endif
+#if WM_FEATURE_METRICS
+    uint16_t connectAttempts = 0; // since boot (not saved)
+    uint16_t connectSuccesses = 0;
+#endif
 } WM_WifiNetwork;
 
+// Scan results with the same SSID (mesh networks, several access points)
+// collapsed into one entry, see wifiman_getScanGroups
+typedef struct WM_ScanGroup {
+    uint8_t scanIndex; // strongest access point
+    uint8_t networkIndex; // -1 if not saved
+    uint8_t bssidCount;
+    uint8_t authMode; // best wifi_auth_mode_t of all access points
+    uint16_t channels; // bit per channel (1 << channel)
+} WM_ScanGroup;
+
 // NOTE (JSchaefer, 28.04.23): We cannot get dynamic data directly from the ESP API
 // since esp_wifi_scan_get_ap_records deletes the internally allocated memory when
 // being called and it is automatically called by the Arduino event loop 
 // (WifiGeneric:934 -> WiFiScanClass::_scanDone()).
+#if WM_FEATURE_DISPLAY_FILTER
 typedef struct WM_WifiNetworkDisplay {
     uint8_t networkIndex;
     uint8_t scanIndex;
 } WM_WifiNetworkDisplay;
 
+// Passed to a WM_ScanVisitor, only valid during the call
+typedef struct WM_ScanEntry {
+    uint8_t networkIndex; // -1 if not saved
+    uint8_t scanIndex; // -1 if not in range (saved networks only)
+    const wifi_ap_record_t *record; // SSID, RSSI, channel, authmode... (nullptr if not in range)
+    const WM_ScanGroup *group; // all access points with this SSID (nullptr if not in range)
+} WM_ScanEntry;
+
+// Predicates applied while visiting, networks not in range never match
+// minRSSI or authModes
+typedef struct WM_ScanFilter {
+    bool knownOnly; // saved networks only
+    int8_t minRSSI; // INT8_MIN for no limit
+    uint32_t authModes; // bit per wifi_auth_mode_t (1 << WIFI_AUTH_WPA2_PSK...), 0 for all
+    bool uniqueSSID; // strongest access point per SSID only (wifiman_visitScan)
+} WM_ScanFilter;
+
+#define WM_SCAN_FILTER_NONE { false, INT8_MIN, 0, false }
+
+// Return false to stop visiting
+typedef bool (*WM_ScanVisitor)(void *context, const WM_ScanEntry *entry);
+#endif
+
 typedef enum WM_StatusCode : uint8_t {
     WM_IDLE_STATUS = 0,
     CONNECTING,
@@ -35,6 +212,7 @@ typedef enum WM_StatusCode : uint8_t {
     DISCONNECTED,
     NETWORK_NOT_FOUND,
     CONNECTION_FAILED,
+    ONLINE, // CONNECTED and uplink probe succeeded (only used if a probe is set)
 } WM_StatusCode;
 
 typedef struct WM_Status {
@@ -44,13 +222,37 @@ typedef struct WM_Status {
         uint8_t connectAttempts;
         uint8_t disconnectReason;
     };
+    uint8_t generation; // incremented on every status change (wraps around)
 } WM_Status;
 
+// One bit per network index (max capacity is 254)
+typedef struct WM_NetworkSet {
+    uint32_t bits[8];
+} WM_NetworkSet;
+
 typedef struct WM_SharedData {
     WM_Status status;
     WM_WifiNetwork **networks;
     uint8_t capacity;
     uint8_t length;
+#if WM_FEATURE_FACTORY_TABLE
+    uint8_t factoryCount; // networks from the factory table, always at the front
+#endif
+#if WM_FEATURE_SORTED_INDEX
+    // Network indices ordered by SSID (case insensitive), read only
+    uint8_t *sorted;
+#endif
+    // Updated by wifiman on every state change, so checks like "is a usable
+    // network in range?" do not need to walk the whole list.
+    // Read only! Use wifiman_setNetworkState to change a state by hand
+    WM_NetworkSet usable; // state UNKNOWN or WORKED_BEFORE
+    WM_NetworkSet failed; // state FAILED_BEFORE
+    WM_NetworkSet offline; // uplink OFFLINE
+    WM_NetworkSet inRange; // found in the latest scan result (updated on scan done
+                           // with WM_FEATURE_AUTOCONNECT, else on connectToBestWifi)
+#if WM_FEATURE_PERSISTENCE
+    WM_NetworkSet dirty; // changed since last read from or save to eeprom
+#endif
 } WM_SharedData;
 
 typedef void (*WM_StatusChangeCallback)(WM_Status *newStatus);
@@ -69,12 +271,89 @@ typedef enum WM_ReturnCode : int8_t {
 } WM_ReturnCode;
 
 #define WM_SCAN_INTERVAL_DEFAULT_MS 30000
+#define WM_SCAN_MAX_AGE_DEFAULT_MS 60000
+
+#define WM_BACKOFF_BASE_DEFAULT_MS 1000
+#define WM_BACKOFF_MAX_DEFAULT_MS 8000
 
 #define WM_RETRIES_NONE 0
 #define WM_RETRIES_FAST 1
 #define WM_RETRIES_DEFAULT 2
 #define WM_RETRIES_CAUTIOUS 3
 
+typedef enum WM_UplinkProbeMode : uint8_t {
+    WM_PROBE_NONE = 0,
+    WM_PROBE_TCP, // TCP connect to host:port
+    WM_PROBE_HTTP_204, // HTTP GET host:port/path, expecting status 204
+} WM_UplinkProbeMode;
+
+#define WM_PROBE_HOST_DEFAULT "connectivitycheck.gstatic.com"
+#define WM_PROBE_PORT_DEFAULT 80
+#define WM_PROBE_PATH_DEFAULT "/generate_204"
+#define WM_PROBE_TIMEOUT_DEFAULT_MS 3000
+
+#define WM_SCAN_MS_PER_CHANNEL_DEFAULT 300
+
+#if WM_FEATURE_DIAGNOSTICS
+// Measured duration of one kind of radio activity
+typedef struct WM_TimingStat {
+    uint32_t count;
+    uint32_t minMs;
+    uint32_t maxMs;
+    uint32_t totalMs; // average is totalMs / count
+} WM_TimingStat;
+
+// RSSI buckets of 10dBm: <= -90, -89 to -80, ..., -49 to -40, >= -39
+#define WM_RSSI_BUCKETS 7
+
+// Radio timing measured on this device since boot. Use this to calibrate scan
+// intervals, retry counts and backoff for your environment.
+typedef struct WM_RadioStats {
+    WM_TimingStat scanActive; // scan issued -> SCAN_DONE (needs WM_FEATURE_AUTOCONNECT)
+    WM_TimingStat scanPassive;
+    WM_TimingStat association; // WiFi.begin -> STA_CONNECTED (auth + 4-way handshake)
+#if WM_FEATURE_PMK_CACHE
+    WM_TimingStat associationCachedPMK; // same, for attempts with a cached PMK
+#endif
+    WM_TimingStat dhcp; // STA_CONNECTED -> GOT_IP
+    WM_TimingStat timeToConnect; // connectToNetwork/BestWifi -> GOT_IP (incl. retries)
+    uint32_t bootToConnectMs; // millis() at the first GOT_IP (0 = not connected yet)
+    // Connect attempts and failures by RSSI of the target in the latest scan
+    // (attempts to networks not in the scan are not counted)
+    uint16_t attemptsByRSSI[WM_RSSI_BUCKETS];
+    uint16_t failuresByRSSI[WM_RSSI_BUCKETS];
+} WM_RadioStats;
+#endif
+
+#if WM_FEATURE_ENERGY
+// Radio activities energy is attributed to (a scan while connected counts for both)
+typedef enum WM_Activity : uint8_t {
+    WM_ACTIVITY_SCAN_ACTIVE = 0, // scan issued -> SCAN_DONE (needs WM_FEATURE_AUTOCONNECT)
+    WM_ACTIVITY_SCAN_PASSIVE,
+    WM_ACTIVITY_CONNECT, // WiFi.begin -> STA_CONNECTED or failure
+    WM_ACTIVITY_CONNECTED, // STA_CONNECTED -> disconnect (idle with power save)
+    WM_ACTIVITY_COUNT
+} WM_Activity;
+
+// Average power draw per activity in mW. Defaults are rough values for an
+// ESP32 at 3.3V, measure your board to get meaningful numbers.
+#define WM_POWER_SCAN_ACTIVE_DEFAULT_MW 400
+#define WM_POWER_SCAN_PASSIVE_DEFAULT_MW 330
+#define WM_POWER_CONNECT_DEFAULT_MW 500
+#define WM_POWER_CONNECTED_DEFAULT_MW 100
+
+typedef struct WM_PowerModel {
+    uint16_t mW[WM_ACTIVITY_COUNT];
+} WM_PowerModel;
+
+typedef struct WM_EnergyStats {
+    uint32_t count[WM_ACTIVITY_COUNT]; // started scans, connect attempts, connections
+    uint64_t radioMs[WM_ACTIVITY_COUNT];
+    uint64_t energyUJ[WM_ACTIVITY_COUNT]; // estimated by the power model at the time
+    uint32_t scansSkipped; // periodic scans skipped because the budget was exhausted
+} WM_EnergyStats;
+#endif
+
 // Create structure used in all wifiman functions
 // Memory will be allocated in this function
 // Returns a pointer to the newly created data
@@ -84,6 +363,10 @@ typedef enum WM_ReturnCode : int8_t {
 WM_SharedData* wifiman_create(WM_WifiNetwork **networkList, uint8_t capacity);
 // Free data and all sub-structures
 void wifiman_free(WM_SharedData *data);
+// Heap bytes owned by data (list, entries and strings, without allocator
+// overhead). Stays constant as long as the list does not change.
+// Equal passwords are stored once, sharedBytes receives the bytes saved by that
+size_t wifiman_getMemoryUsage(WM_SharedData *data, size_t *sharedBytes = nullptr);
 
 // Start wifiman service
 // Will attach to certain wifi events to update state of known networks
@@ -98,20 +381,209 @@ void wifiman_free(WM_SharedData *data);
 // to a specific one or just call connectToBestWifi).
 // Wifiman will keep a connection for as long as possible and not switch
 // even if a "better" network might be available.
+// autoConnect is ignored if built without WM_FEATURE_AUTOCONNECT.
 void wifiman_start(
         WM_SharedData *data, 
         bool autoConnect, 
         WM_StatusChangeCallback callback = nullptr, 
         uint32_t scanInterval = WM_SCAN_INTERVAL_DEFAULT_MS
         );
+#if WM_FEATURE_PERSISTENCE && WM_FEATURE_AUTOCONNECT
+// One-call boot: same as wifiman_start, but also loads the network list from
+// eeprom and, with autoConnect, connects to the best network.
+// A scan is started right away while the worker reads the list in parallel,
+// once both are done the boot is complete and wifiman connects (like
+// connectToBestWifi) if autoConnect is set.
+// data has to be empty (created with wifiman_create(nullptr, capacity), only
+// factory networks may be loaded already) and must not be changed until the
+// boot is complete, see wifiman_bootPending (or WM_WAIT_BOOT_DONE).
+void wifiman_startAsync(
+        WM_SharedData *data, 
+        bool autoConnect, 
+        WM_StatusChangeCallback callback = nullptr, 
+        uint32_t scanInterval = WM_SCAN_INTERVAL_DEFAULT_MS
+        );
+// True while the list load or the first scan of wifiman_startAsync is running
+bool wifiman_bootPending();
+#endif
 // Stop wifiman service
 // Removes all events and stops background threads
 void wifiman_stop();
 
+// Latest status of the running wifiman service, wait-free and safe to call
+// from ISRs, high priority tasks and callbacks (no locks are taken).
+// The status is published as a single word, so all fields belong together.
+// Compare generation with a previous read to detect changes in between.
+WM_Status wifiman_getStatusFromISR();
+
+// Start a scan for networks (in the background if built with WM_FEATURE_WORKER).
+// Results are available via WiFi.scanComplete as usual.
+void wifiman_scan();
+
+#if WM_FEATURE_WAITERS
+typedef enum WM_WaitEvent : uint8_t {
+    WM_WAIT_STATUS = 0, // every status change
+    WM_WAIT_SCAN_DONE, // scan finished (needs WM_FEATURE_AUTOCONNECT)
+    // wifiman_startAsync complete, fired before connecting. Add the waiter
+    // first, then remove it again if wifiman_bootPending is false already.
+    WM_WAIT_BOOT_DONE,
+} WM_WaitEvent;
+
+// One-shot completion hook, i.e. to resume a coroutine or unblock a task.
+// The memory is owned by the caller and must stay valid until the waiter was
+// resumed or removed. Wifiman does not allocate anything for waiters.
+typedef struct WM_Waiter {
+    WM_WaitEvent event;
+    // Called for each matching event inside a critical section, so only look
+    // at status and return true if the waiter is done (nullptr: always done)
+    bool (*ready)(void *context, const WM_Status *status);
+    // Called once after the waiter was removed from the list (no lock held),
+    // in the context of the event (Arduino event task or wifiman worker)
+    void (*resume)(void *context, const WM_Status *status);
+    void *context;
+    struct WM_Waiter *next; // internal
+} WM_Waiter;
+
+void wifiman_addWaiter(WM_Waiter *waiter);
+// Returns true if the waiter was removed before it fired (resume will not be
+// called) or false if it already fired (resume was or is being called)
+bool wifiman_removeWaiter(WM_Waiter *waiter);
+#endif
+
 // Set interval in which a scan for networks is done (if not currently connected)
 void wifiman_setScanInterval(uint32_t newInterval);
 uint32_t wifiman_getScanInterval();
 
+// Set max. age of scan results used by wifiman_connectToBestWifi, older
+// results will trigger a new scan
+void wifiman_setScanMaxAge(uint32_t maxAge);
+uint32_t wifiman_getScanMaxAge();
+
+// Set parameters used for all scans issued by wifiman
+// Passive scans only listen for beacons (slower, but use less power and are
+// required on some channels in some regions). msPerChannel is the dwell time
+// per channel (active: max. time, passive: time per channel)
+void wifiman_setScanParameters(bool passive, uint16_t msPerChannel = WM_SCAN_MS_PER_CHANNEL_DEFAULT);
+
+#if WM_FEATURE_FAST_SCAN
+// 2.4GHz channels visited by a channel ordered scan
+#define WM_SCAN_CHANNELS 13
+// Default "good enough" score (for the default scoring policy this is the RSSI)
+#define WM_FAST_SCAN_GOOD_SCORE_DEFAULT -67
+// Delay of the full scan after a sweep exited early (finishLater)
+#define WM_FAST_SCAN_FINISH_DELAY_MS 10000
+
+// Scans done to find a network to connect to (connectToBestWifi, periodic
+// background scans) are done one channel at a time instead: first the channels
+// saved networks were last seen on, then all others. The sweep stops as soon
+// as a usable network scores at least goodScore and wifiman connects to it.
+// Otherwise the best network of all channels is used, as with a full scan.
+// If finishLater is set, an early exit is followed by a full scan after
+// WM_FAST_SCAN_FINISH_DELAY_MS, so the rest of the scan results is available.
+// Other scans (wifiman_scan, display filters) still cover all channels at once.
+void wifiman_setFastScan(bool enabled, int goodScore = WM_FAST_SCAN_GOOD_SCORE_DEFAULT, bool finishLater = false);
+bool wifiman_getFastScan();
+#endif
+
+#if WM_FEATURE_POWER_SAVE
+// Let wifiman manage modem power save: no power save while connecting, scanning
+// or probing the uplink, idleLevel once connected and idle.
+// WIFI_PS_MIN_MODEM wakes up on every DTIM, WIFI_PS_MAX_MODEM only every
+// listen interval (lower power, higher latency).
+// Power save is not touched by wifiman until this is called.
+void wifiman_setPowerSave(wifi_ps_type_t idleLevel);
+wifi_ps_type_t wifiman_getPowerSave();
+// Keep the modem awake until the matching release, i.e. around a large
+// transfer or a latency critical exchange. Requests are counted, every
+// request needs exactly one release.
+void wifiman_requestHighPerformance();
+void wifiman_releaseHighPerformance();
+#endif
+
+#if WM_FEATURE_WATCHDOG
+// Deadlines of the health watchdog. The worker checks them once a second:
+// a scan still running WM_WATCHDOG_SCAN_MS longer than the dwell time of all
+// channels (see wifiman_setScanParameters) is aborted, a connect attempt
+// without GOT_IP after WM_WATCHDOG_CONNECT_MS is restarted. If something gets
+// stuck again without any progress in between, the STA driver is reinitialized
+// instead. A worker without a loop iteration for WM_WATCHDOG_WORKER_MS (i.e.
+// starved by other tasks on core 0) runs at a higher priority until its next
+// iteration. Every recovery is counted in wifiman_watchdog_recoveries_total.
+#ifndef WM_WATCHDOG_SCAN_MS
+#define WM_WATCHDOG_SCAN_MS 10000
+#endif
+#ifndef WM_WATCHDOG_CONNECT_MS
+#define WM_WATCHDOG_CONNECT_MS 30000
+#endif
+#ifndef WM_WATCHDOG_WORKER_MS
+#define WM_WATCHDOG_WORKER_MS 10000
+#endif
+#endif
+
+#if WM_FEATURE_METRICS
+// Write all wifiman metrics (scans, connect attempts and successes per network,
+// retries, time to connect, worker wakeups and stack, queue depth, flash
+// writes, ...) in Prometheus text exposition format. Does not allocate any memory.
+void wifiman_printMetrics(Print *output);
+// Minimal HTTP handler for scraping, use with your own WiFiServer:
+//      WiFiClient client = server.available();
+//      if (client)
+//          wifiman_handleMetricsRequest(client);
+// Answers "GET /metrics" with wifiman_printMetrics and everything else with 404,
+// then closes the connection. Waits up to timeoutMs for the request headers.
+// Returns true if metrics were sent
+bool wifiman_handleMetricsRequest(WiFiClient &client, uint16_t timeoutMs = 1000);
+#endif
+
+#if WM_FEATURE_TRACE
+#ifndef WM_TRACE_BUFFER_SIZE
+#define WM_TRACE_BUFFER_SIZE 256 // 8 bytes each
+#endif
+
+typedef enum WM_TraceType : uint8_t {
+    WM_TRACE_SCAN_ISSUED = 0,
+    WM_TRACE_CONNECT_ISSUED,
+    WM_TRACE_SCAN_PICKED_UP,
+    WM_TRACE_CONNECT_PICKED_UP,
+    WM_TRACE_SCAN_EXEC,
+    WM_TRACE_CONNECT_EXEC,
+    WM_TRACE_UPLINK_PROBE,
+    WM_TRACE_EVENT_CONNECTED,
+    WM_TRACE_EVENT_DISCONNECTED,
+    WM_TRACE_EVENT_GOT_IP,
+    WM_TRACE_EVENT_SCAN_DONE,
+    WM_TRACE_STATUS_CALLBACK,
+    WM_TRACE_WAIT_SCAN_LOCK,
+    WM_TRACE_WAIT_CONNECT_LOCK,
+    WM_TRACE_RADIO_SCAN, // scan start -> SCAN_DONE
+    WM_TRACE_RADIO_CONNECT, // WiFi.begin -> STA_CONNECTED/DISCONNECTED
+    WM_TRACE_RADIO_LINK_LOST, // STA_DISCONNECTED outside of a connect attempt
+} WM_TraceType;
+
+// One lane per task (+ one for the radio)
+typedef enum WM_TraceLane : uint8_t {
+    WM_TRACE_LANE_APP = 0, // any other task calling wifiman functions
+    WM_TRACE_LANE_WORKER,
+    WM_TRACE_LANE_EVENT,
+    WM_TRACE_LANE_RADIO,
+} WM_TraceLane;
+
+typedef struct WM_TraceEvent {
+    uint32_t timeUs; // micros()
+    WM_TraceType type;
+    char phase; // 'B'egin, 'E'nd or 'i'nstant (as in Chrome trace format)
+    WM_TraceLane lane;
+    uint8_t arg; // network index, disconnect reason, status code, ...
+} WM_TraceEvent;
+
+// Recording is enabled by default (if compiled with WM_FEATURE_TRACE)
+void wifiman_setTraceEnabled(bool enabled);
+void wifiman_clearTrace();
+// Write recorded events as Chrome trace JSON (load in chrome://tracing or
+// ui.perfetto.dev). Recording is paused while printing.
+void wifiman_printTrace(Print *output);
+#endif
+
 // In an ideal world connecting to a wifi will either work or produce the appropriate
 // error. In reality an error which looks like wrong-password might be encountered, 
 // despite supplying the correct login info. This might be because of low signal strength,
@@ -124,7 +596,62 @@ uint32_t wifiman_getScanInterval();
 // NOTE: callbacks on error are only called for the final try (after the set retry count)
 void wifiman_setRetryCount(uint8_t count);
 uint8_t wifiman_getRetryCount();
+// Set delay between retries. The delay doubles with each retry (starting at
+// baseMs) up to maxMs. Defaults are 1 - 2 - 4 - 8 - 8 - ... seconds.
+void wifiman_setRetryBackoff(uint32_t baseMs, uint32_t maxMs);
+uint32_t wifiman_getRetryBackoffBase();
+uint32_t wifiman_getRetryBackoffMax();
+
+// Being CONNECTED only means we are associated with an access point, not that
+// the network is actually usable (captive portals, dead uplinks, ...).
+// Set a probe here, which will be run from the background task after each
+// GOT_IP event. The probe time (RTT) and result are saved to the network entry
+// and the status changes to ONLINE on success.
+// Networks which failed the probe are only used for auto connection if no other
+// known network is in range and lower RTTs are preferred (when autoConnect is on).
+// If autoConnect is on and the probe fails, wifiman will look for a different 
+// network to switch to.
+// Host and path are copied. Pass WM_PROBE_NONE to disable (default).
+#if WM_FEATURE_UPLINK_PROBE
+void wifiman_setUplinkProbe(
+        WM_UplinkProbeMode mode, 
+        const char *host = WM_PROBE_HOST_DEFAULT, 
+        uint16_t port = WM_PROBE_PORT_DEFAULT, 
+        const char *path = WM_PROBE_PATH_DEFAULT,
+        uint16_t timeoutMs = WM_PROBE_TIMEOUT_DEFAULT_MS
+        );
+WM_UplinkProbeMode wifiman_getUplinkProbe();
+#endif
 
+#if WM_FEATURE_FACTORY_TABLE
+// Entry of a factory network table, generated by tools/wifiman_factory.py
+typedef struct WM_FactoryNetwork {
+    const char *ssid;
+    const char *pass; // passphrase, precomputed PMK (64 hex digits) or nullptr
+} WM_FactoryNetwork;
+
+// Add all networks of a read-only table (in flash) to the front of the list.
+// SSIDs and passwords are referenced, not copied. Changed states, deleted
+// networks and changed passwords are kept in a small overlay in NVS (saved
+// by wifiman_saveToEEPROM). The overlay is discarded if signature changes,
+// i.e. with a new table or a changed SSID, order or password.
+// Call on an empty list, before wifiman_readFromEEPROM (user networks follow
+// the factory networks and are saved as before).
+// Returns the amount of networks added
+uint8_t wifiman_loadFactoryNetworks(WM_SharedData *data, const WM_FactoryNetwork *table, uint8_t count, uint32_t signature);
+#endif
+
+#if WM_FEATURE_PARTITION_TABLE
+// Same as wifiman_loadFactoryNetworks, but the table is read from a data
+// partition (image generated by tools/wifiman_factory.py --partition).
+// The partition is memory mapped once and SSIDs and passwords are used in
+// place, so large tables cost neither heap nor firmware size.
+// Returns the amount of networks added (0 if the partition is missing or
+// invalid, or if it was loaded before)
+uint8_t wifiman_loadPartitionNetworks(WM_SharedData *data, const char *label = "wifiman");
+#endif
+
+#if WM_FEATURE_PERSISTENCE
 // Read network data from eeprom and save to data pointer
 // Pass values for startIndex and count to restrict to a certain range
 // If count is -1 it will read all networks starting at startIndex
@@ -133,12 +660,45 @@ uint8_t wifiman_readFromEEPROM(WM_SharedData *data, uint8_t startIndex = 0, uint
 // Save network data to eeprom
 // Pass values for startIndex and count to restrict to a certain range
 // If count is -1 it will save all networks starting at startIndex
-void wifiman_saveToEEPROM(WM_SharedData *data, uint8_t startIndex = 0, uint8_t count = -1);
+// By default only networks changed since the last read or save (by wifiman 
+// functions, see WM_SharedData::dirty) are written to save flash writes.
+// Pass onlyChanged = false if you modified the list by hand.
+void wifiman_saveToEEPROM(WM_SharedData *data, uint8_t startIndex = 0, uint8_t count = -1, bool onlyChanged = true);
+
+// NVS stores data in 32 byte entries, 126 per 4kB flash page. Every write of a
+// key needs new entries (old ones are only marked as erased) and once a page
+// is full it is erased as a whole, so page erases are about entriesWritten / 126.
+#define WM_NVS_ENTRIES_PER_PAGE 126
+#define WM_NVS_ERASE_CYCLES 100000
+#define WM_NVS_PAGES_DEFAULT 5 // 0x5000 bytes in the default partition tables
+
+// Flash cost of wifiman_readFromEEPROM/saveToEEPROM since boot
+typedef struct WM_StorageStats {
+    uint32_t reads;
+    uint32_t saves;
+    uint32_t keysWritten;
+    uint32_t keysRemoved;
+    uint32_t entriesWritten; // 32 byte NVS entries
+    uint32_t lastReadUs; // duration of the last call
+    uint32_t lastSaveUs;
+} WM_StorageStats;
+
+const WM_StorageStats* wifiman_getStorageStats();
+// Estimate days until the NVS partition (nvsPages 4kB pages) wears out if the
+// network list is saved savesPerDay times, based on the average flash cost of
+// all saves done so far.
+// Returns 0 if there is no data yet (or -1 if nothing was written)
+uint32_t wifiman_estimateFlashLifetimeDays(uint32_t savesPerDay, uint8_t nvsPages = WM_NVS_PAGES_DEFAULT);
+#endif
+
+// Longest SSID and passphrase (64 hex digits PSK) WiFi accepts
+#define WM_MAX_SSID_LENGTH 32
+#define WM_MAX_PASS_LENGTH 64
 
 // Add new network to list or update an existing entry with the same SSID
 // NOTE: Two different networks with the same SSID are currently not supported
 // existingUpdated can be used to check if an update happened (pass nullptr if value is not needed)
-// Returns index of new or updated entry or -1 on error
+// Returns index of new or updated entry or -1 on error (also if ssid or pass is too long)
 uint8_t wifiman_addOrUpdateNetwork(WM_SharedData *data, const char *ssid, const char *pass, bool *existingUpdated = nullptr);
 // Delete network from list
 // back part of list will be shifted to front, so no gaps are created!
@@ -153,20 +713,88 @@ uint8_t wifiman_findNetworkInList(WM_SharedData *data, const char *ssid);
 // Search for a SSID in the network list
 // Returns index if network was found or -1
 uint8_t wifiman_findNetworkInList(WM_SharedData *data, const uint8_t *ssid, const uint8_t ssidLen);
+#if WM_FEATURE_SORTED_INDEX
+// Query the sorted index, e.g. for search-as-you-type. The result is a range
+// of positions in data->sorted, which holds network indices, so nothing is
+// copied:
+//      uint8_t first;
+//      uint8_t count = wifiman_findNetworksByPrefix(data, "ACME-", &first);
+//      for (int i = first; i < first + count; ++i)
+//          show(data->networks[data->sorted[i]]->ssid);
+// Positions and indices are valid until the list changes.
+// Comparison is case insensitive, an empty prefix matches all networks.
+// Returns the amount of matching networks
+uint8_t wifiman_findNetworksByPrefix(WM_SharedData *data, const char *prefix, uint8_t *first);
+// Same for SSIDs from "from" (inclusive) to "to" (exclusive), nullptr for an open end
+uint8_t wifiman_findNetworksInRange(WM_SharedData *data, const char *from, const char *to, uint8_t *first);
+#endif
 // Count all networks that are suitable for auto connection
 // This includes networks with state UNKNOWN or WORKED_BEFORE
 uint8_t wifiman_countUsableNetworks(WM_SharedData *data);
+// Check if any network suitable for auto connection was found in the latest scan
+bool wifiman_anyUsableInRange(WM_SharedData *data);
+// Set working state of the network with the given index (and update the 
+// network sets in data accordingly)
+void wifiman_setNetworkState(WM_SharedData *data, uint8_t index, WM_NetworkWorkingState state);
+
+// Get the current scan result grouped by SSID (in order of first appearance),
+// computed once per scan. Valid until the next scan or list change, so hold
+// wifiman_lockScanResults while using them.
+// Returns the amount of groups (0 if no scan result is available)
+uint8_t wifiman_getScanGroups(const WM_ScanGroup **groups);
+// The scan result (WiFi.getScanInfoByIndex, ...) and the groups built from it
+// are replaced by the event task and the worker after each scan. Hold this
+// lock while using them outside of wifiman calls and keep it short, no scan
+// can start or be evaluated meanwhile. Recursive, wifiman calls can be made
+// while holding it.
+void wifiman_lockScanResults();
+void wifiman_unlockScanResults();
+
+#if WM_FEATURE_PMK_CACHE
+// Networks that use WPA/WPA2-PSK (according to the latest scan) connect with
+// their PMK instead of the passphrase once it was derived, which skips the
+// PBKDF2 run (4096 SHA1 rounds) on every connect. The PMK is derived by the
+// worker after the first successful connect and kept in RTC memory, so it
+// survives deep sleep. A failed attempt with a cached PMK drops the entry.
+// WPA3 (SAE) and 802.1X networks always use the passphrase.
+#ifndef WM_PMK_CACHE_SIZE
+#define WM_PMK_CACHE_SIZE 4
+#endif
+void wifiman_clearPMKCache();
+#endif
 
 // Connect to the network with the given index
 WM_ReturnCode wifiman_connectToNetwork(WM_SharedData *data, uint8_t index);
 // Connect to the known network with the lowest RSSI currently in range
+// (adjusted by the uplink probe results, see wifiman_setUplinkProbe)
 // This requires an active network scan result. If that is not present
 // it will start a scan and return the respective error code.
 WM_ReturnCode wifiman_connectToBestWifi(WM_SharedData *data);
 
+#if WM_FEATURE_DIAGNOSTICS
 // Print WM_SharedData structure to Serial in human readable form
 void wifiman_print(WM_SharedData *data, HardwareSerial *output);
+// Get radio timings and connect failures measured since boot
+const WM_RadioStats* wifiman_getRadioStats();
+#endif
+
+#if WM_FEATURE_ENERGY
+// Set power draw per activity used for all energy estimates from now on
+void wifiman_setPowerModel(const WM_PowerModel *model);
+const WM_PowerModel* wifiman_getPowerModel();
+// Radio-on time and energy since boot, including activities still running
+WM_EnergyStats wifiman_getEnergyStats();
+// Allow periodic background scans to use at most millijoules per periodMs.
+// Once the budget of the current period is spent, periodic scans are skipped
+// until the next period starts. Scans started by the user or by connection
+// handling are not limited, but count against the budget.
+// A budget of 0 disables the limit (default)
+void wifiman_setScanEnergyBudget(uint32_t millijoules, uint32_t periodMs);
+// Energy left in the current budget period (or -1 if there is no budget)
+uint32_t wifiman_getScanEnergyRemaining();
+#endif
 
+#if WM_FEATURE_DISPLAY_FILTER
 // Fill the passed networks array with results from wifi scan and compare to saved networks.
 // Networks will have the same order as in the scan results and their index in wifiman_data
 // (if matching SSID is found - else -1)
@@ -189,4 +817,20 @@ WM_ReturnCode wifiman_getDisplayFilterByScan(WM_WifiNetworkDisplay networks[], u
 WM_ReturnCode wifiman_getDisplayFilterBySaved(WM_WifiNetworkDisplay networks[], uint8_t count,
         WM_WifiNetworkDisplay scanFilter[] = nullptr, uint8_t scanCount = 0);
 
+// Same as wifiman_getDisplayFilterByScan without a caller buffer: calls
+// visitor for every scan result (in scan order) that matches filter
+// (nullptr for all). Nothing is copied, entries point into the scan result.
+//
+// Returns
+//      WMRT_SUCCESS if all matching results were visited (or visitor stopped)
+//      WMRT_SCAN_NOT_READY if no scan results are available
+WM_ReturnCode wifiman_visitScan(const WM_ScanFilter *filter, WM_ScanVisitor visitor, void *context = nullptr);
+
+// Same as wifiman_getDisplayFilterBySaved without a caller buffer: calls
+// visitor for every saved network (in list order) that matches filter, with
+// its strongest access point if in range. Without a scan result all networks
+// are visited as not in range.
+WM_ReturnCode wifiman_visitSaved(const WM_ScanFilter *filter, WM_ScanVisitor visitor, void *context = nullptr);
+#endif
+
 #endif // _WIFI_MANAGER_H_INCLUDE
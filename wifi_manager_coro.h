@@ -0,0 +1,295 @@
+#ifndef _WIFI_MANAGER_CORO_H_INCLUDE
+#define _WIFI_MANAGER_CORO_H_INCLUDE
+
+// Awaitable wrappers for C++20 coroutines:
+//      WM_Async wifiman(data);
+//      WM_AsyncResult result = co_await wifiman.connect(index);
+//      if (result.status.code == CONNECTED)
+//          result = co_await wifiman.waitOnline(10000);
+//
+// No extra task and no polling: the coroutine is resumed right from the
+// completion path of wifiman (Arduino event task or wifiman worker, esp_timer
+// task on timeout). Keep the code up to the next co_await short or pass a
+// resumer, which hands the coroutine to your own executor instead.
+
+#include "wifi_manager.h"
+
+#if ! WM_FEATURE_WAITERS
+#error "wifiman: wifi_manager_coro.h requires WM_FEATURE_WAITERS"
+#endif
+
+#include <atomic>
+#include <coroutine>
+#include <esp_timer.h>
+
+// Called instead of handle.resume() to continue an awaiting coroutine
+typedef void (*WM_Resumer)(std::coroutine_handle<> handle);
+
+typedef struct WM_AsyncResult {
+    WM_ReturnCode returnCode; // of the call starting the operation
+    WM_Status status; // when the operation completed (or timed out)
+    bool timedOut;
+} WM_AsyncResult;
+
+typedef enum WM_AsyncOperation : uint8_t {
+    WM_ASYNC_CONNECT = 0,
+    WM_ASYNC_CONNECT_BEST,
+    WM_ASYNC_SCAN,
+    WM_ASYNC_WAIT_ONLINE,
+} WM_AsyncOperation;
+
+class WM_Awaiter
+{
+public:
+    WM_Awaiter(WM_SharedData *data, WM_AsyncOperation operation, uint8_t index, uint32_t timeoutMs, WM_Resumer resumer) :
+        _data(data), _operation(operation), _index(index), _timeoutMs(timeoutMs), _resumer(resumer)
+    {
+        _result.returnCode = WMRT_SUCCESS;
+        _result.timedOut = false;
+    }
+
+    WM_Awaiter(const WM_Awaiter&) = delete;
+    WM_Awaiter& operator=(const WM_Awaiter&) = delete;
+
+    bool await_ready()
+    {
+        if (_operation != WM_ASYNC_WAIT_ONLINE)
+            return false;
+
+        _result.status = wifiman_getStatusFromISR();
+        return _done(&_result.status);
+    }
+
+    bool await_suspend(std::coroutine_handle<> handle)
+    {
+        _handle = handle;
+        // Completed by whoever comes last: this function or the waiter/timeout
+        _pending.store(2);
+
+        _waiter.event = (_operation == WM_ASYNC_SCAN ? WM_WAIT_SCAN_DONE : WM_WAIT_STATUS);
+        _waiter.ready = (_operation == WM_ASYNC_SCAN ? nullptr : &WM_Awaiter::_waiterReady);
+        _waiter.resume = &WM_Awaiter::_waiterResume;
+        _waiter.context = this;
+        wifiman_addWaiter(&_waiter);
+
+#if WM_FEATURE_AUTOCONNECT
+        if (_operation == WM_ASYNC_CONNECT_BEST)
+        {
+            // Connect once the scan started by wifiman_connectToBestWifi is
+            // done, registered first so its SCAN_DONE cannot be missed.
+            // The status is ignored until then.
+            _scanning.store(true);
+            _pending.fetch_add(1);
+            _scanWaiter.event = WM_WAIT_SCAN_DONE;
+            _scanWaiter.resume = &WM_Awaiter::_scanDone;
+            _scanWaiter.context = this;
+            wifiman_addWaiter(&_scanWaiter);
+        }
+#endif
+
+        if (_timeoutMs != 0)
+        {
+            esp_timer_create_args_t args = {};
+            args.callback = &WM_Awaiter::_timeout;
+            args.arg = this;
+            args.name = "wifiman_await";
+            esp_timer_create(&args, &_timer);
+            esp_timer_start_once(_timer, (uint64_t)_timeoutMs * 1000);
+        }
+
+        bool scanning = false;
+        switch (_operation)
+        {
+            case WM_ASYNC_CONNECT:
+                _result.returnCode = wifiman_connectToNetwork(_data, _index);
+                break;
+            case WM_ASYNC_CONNECT_BEST:
+            {
+                WM_ReturnCode returnCode = wifiman_connectToBestWifi(_data);
+#if WM_FEATURE_AUTOCONNECT
+                // _scanDone connects and reports the result (also if the
+                // SCAN_DONE of another scan came in between)
+                scanning = (returnCode == WMRT_SCAN_NOT_READY || ! _scanning.exchange(false));
+                if (scanning)
+                    break;
+
+                // Results were fresh, no need to wait for a scan
+                if (wifiman_removeWaiter(&_scanWaiter))
+                    _pending.fetch_sub(1);
+#endif
+                _result.returnCode = returnCode;
+                break;
+            }
+            case WM_ASYNC_SCAN:
+                wifiman_scan();
+                break;
+            case WM_ASYNC_WAIT_ONLINE:
+                break;
+        }
+
+        // Nothing will happen if the operation could not be started
+        if (! scanning && _result.returnCode < 0 && wifiman_removeWaiter(&_waiter))
+        {
+            _result.status = wifiman_getStatusFromISR();
+            // Suspend only if the SCAN_DONE of another scan is being handled
+            return _pending.fetch_sub(2) != 2;
+        }
+
+        // Do not touch this after the decrement, it might be resumed already
+        return _pending.fetch_sub(1) != 1;
+    }
+
+    WM_AsyncResult await_resume()
+    {
+        if (_timer != nullptr)
+        {
+            esp_timer_stop(_timer);
+            esp_timer_delete(_timer);
+            _timer = nullptr;
+        }
+
+        return _result;
+    }
+
+private:
+    bool _done(const WM_Status *status) const
+    {
+        switch (_operation)
+        {
+            case WM_ASYNC_CONNECT:
+            case WM_ASYNC_CONNECT_BEST:
+                // DISCONNECTED is reported for our own disconnect before connecting
+                if (_operation == WM_ASYNC_CONNECT && status->targetNetwork != _index)
+                    return false;
+                if (_scanning.load())
+                    return false;
+                return status->code == CONNECTED || status->code == ONLINE ||
+                        status->code == NETWORK_NOT_FOUND || status->code == CONNECTION_FAILED;
+            case WM_ASYNC_WAIT_ONLINE:
+                if (status->code == ONLINE)
+                    return true;
+#if WM_FEATURE_UPLINK_PROBE
+                return status->code == CONNECTED && wifiman_getUplinkProbe() == WM_PROBE_NONE;
+#else
+                return status->code == CONNECTED;
+#endif
+            default:
+                return true;
+        }
+    }
+
+    void _complete()
+    {
+        if (_pending.fetch_sub(1) != 1)
+            return;
+
+        if (_resumer != nullptr)
+            _resumer(_handle);
+        else
+            _handle.resume();
+    }
+
+    static bool _waiterReady(void *context, const WM_Status *status)
+    {
+        return ((WM_Awaiter*)context)->_done(status);
+    }
+
+    static void _waiterResume(void *context, const WM_Status *status)
+    {
+        WM_Awaiter *self = (WM_Awaiter*)context;
+        self->_result.status = *status;
+        self->_complete();
+    }
+
+#if WM_FEATURE_AUTOCONNECT
+    static void _scanDone(void *context, const WM_Status *status)
+    {
+        WM_Awaiter *self = (WM_Awaiter*)context;
+
+        // await_suspend might have connected already
+        if (self->_scanning.exchange(false))
+        {
+            self->_result.returnCode = wifiman_connectToBestWifi(self->_data);
+            // Nothing will happen, complete in place of the status waiter
+            if (self->_result.returnCode < 0 && wifiman_removeWaiter(&self->_waiter))
+            {
+                self->_result.status = wifiman_getStatusFromISR();
+                self->_complete();
+            }
+        }
+
+        self->_complete();
+    }
+#endif
+
+    static void _timeout(void *context)
+    {
+        WM_Awaiter *self = (WM_Awaiter*)context;
+
+        // Lost the race against the waiter, which resumes the coroutine
+        if (! wifiman_removeWaiter(&self->_waiter))
+            return;
+
+        self->_result.status = wifiman_getStatusFromISR();
+        self->_result.timedOut = true;
+#if WM_FEATURE_AUTOCONNECT
+        // Still waiting for the scan (else it was removed or _scanDone runs)
+        if (self->_operation == WM_ASYNC_CONNECT_BEST && wifiman_removeWaiter(&self->_scanWaiter))
+            self->_pending.fetch_sub(1);
+#endif
+        self->_complete();
+    }
+
+    WM_SharedData *_data;
+    WM_AsyncOperation _operation;
+    uint8_t _index;
+    uint32_t _timeoutMs;
+    WM_Resumer _resumer;
+    WM_AsyncResult _result;
+    WM_Waiter _waiter = {};
+    WM_Waiter _scanWaiter = {}; // WM_ASYNC_CONNECT_BEST with old scan results
+    esp_timer_handle_t _timer = nullptr;
+    std::coroutine_handle<> _handle;
+    std::atomic<uint8_t> _pending { 0 };
+    std::atomic<bool> _scanning { false };
+};
+
+// Entry point for coroutines, wifiman has to be started (wifiman_start).
+// A timeoutMs of 0 waits forever.
+class WM_Async
+{
+public:
+    explicit WM_Async(WM_SharedData *data, WM_Resumer resumer = nullptr) : _data(data), _resumer(resumer) {}
+
+    // Completes with the first result of the attempt (CONNECTED or a failure,
+    // wifiman might still retry after a failure)
+    WM_Awaiter connect(uint8_t index, uint32_t timeoutMs = 0)
+    {
+        return WM_Awaiter(_data, WM_ASYNC_CONNECT, index, timeoutMs, _resumer);
+    }
+    // Scans first if the results are too old (without WM_FEATURE_AUTOCONNECT
+    // it completes right away with WMRT_SCAN_NOT_READY instead, try again
+    // once WiFi.scanComplete has results)
+    WM_Awaiter connectToBest(uint32_t timeoutMs = 0)
+    {
+        return WM_Awaiter(_data, WM_ASYNC_CONNECT_BEST, -1, timeoutMs, _resumer);
+    }
+#if WM_FEATURE_AUTOCONNECT
+    // Completes on SCAN_DONE, results via WiFi.scanComplete/WiFi.SSID(i)...
+    WM_Awaiter scan(uint32_t timeoutMs = 0)
+    {
+        return WM_Awaiter(_data, WM_ASYNC_SCAN, -1, timeoutMs, _resumer);
+    }
+#endif
+    // ONLINE if an uplink probe is set, else CONNECTED
+    WM_Awaiter waitOnline(uint32_t timeoutMs = 0)
+    {
+        return WM_Awaiter(_data, WM_ASYNC_WAIT_ONLINE, -1, timeoutMs, _resumer);
+    }
+
+private:
+    WM_SharedData *_data;
+    WM_Resumer _resumer;
+};
+
+#endif
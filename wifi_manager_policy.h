@@ -0,0 +1,102 @@
+#ifndef _WIFI_MANAGER_POLICY_H_INCLUDE
+#define _WIFI_MANAGER_POLICY_H_INCLUDE
+
+#include <limits.h>
+
+#include "wifi_manager.h"
+
+// Strategies used by wifiman for network selection, reconnects and persistence.
+// These are resolved at compile time, so the selection loop does not pay for
+// an indirect call per access point and unused strategies are not linked.
+// 
+// To replace a policy, write a struct with the same static functions as the
+// default one and pass the header and struct name in your build flags, e.g.
+//      -DWM_POLICY_HEADER=\"my_wifiman_policies.h\" -DWM_SCORING_POLICY=MyScoringPolicy
+
+// Return value of ScoringPolicy::score to ignore a network
+#define WM_SCORE_SKIP INT_MIN
+
+// Score penalty for networks without working uplink, so they are only picked
+// if nothing else is in range (larger than the whole RSSI range)
+#define WM_UPLINK_OFFLINE_PENALTY 1000
+// Every x ms of uplink RTT count as 1dBm less RSSI
+#define WM_UPLINK_RTT_MS_PER_DB 20
+
+// Highest RSSI wins, adjusted by the uplink probe results
+struct WM_ScoringPolicyDefault
+{
+    // Score of a known network found in scan results (higher is better) or
+    // WM_SCORE_SKIP. Networks which FAILED_BEFORE are never passed here.
+    // connected is set, if we would switch away from an active connection
+    // (i.e. because the uplink probe failed)
+    static inline int score(const WM_WifiNetwork *network, int rssi, bool connected)
+    {
+        switch (network->uplink)
+        {
+            case UPLINK_OFFLINE:
+                if (connected)
+                    return WM_SCORE_SKIP;
+                return rssi - WM_UPLINK_OFFLINE_PENALTY;
+            case UPLINK_ONLINE:
+                return rssi - network->uplinkRTT / WM_UPLINK_RTT_MS_PER_DB;
+            default:
+                return rssi;
+        }
+    }
+};
+
+// Retry up to maxRetries times with exponential backoff
+struct WM_RetryPolicyDefault
+{
+    // Should we try to reconnect after a disconnect with the given reason?
+    // If this returns false the network is marked as FAILED_BEFORE (unless
+    // the disconnect was intentional)
+    static inline bool shouldRetry(uint8_t retryCount, uint8_t maxRetries, uint8_t reason)
+    {
+        return retryCount < maxRetries && reason != WIFI_REASON_ASSOC_LEAVE;
+    }
+
+    // Delay before the reconnect, retryCount starts at 0
+    // baseMs and maxMs are set by wifiman_setRetryBackoff
+    static inline uint32_t backoffMs(uint8_t retryCount, uint32_t baseMs, uint32_t maxMs)
+    {
+        // connect after base * 1 - 2 - 4 - 8 - ...
+        uint64_t delay = (retryCount >= 32 ? UINT64_MAX : (uint64_t)baseMs << retryCount);
+        return delay > maxMs ? maxMs : delay;
+    }
+};
+
+// One key each for SSID, password and state per network in NVS (Preferences)
+// Called by wifiman_readFromEEPROM and wifiman_saveToEEPROM, see there
+struct WM_StoragePolicyNVS
+{
+    static uint8_t read(WM_SharedData *data, uint8_t startIndex, uint8_t count);
+    // changed is nullptr if all networks in the range should be written
+    static void save(WM_SharedData *data, uint8_t startIndex, uint8_t count, const WM_NetworkSet *changed);
+};
+
+template <class ScoringPolicy, class RetryPolicy, class StoragePolicy>
+struct WM_PolicySet
+{
+    typedef ScoringPolicy Scoring;
+    typedef RetryPolicy Retry;
+    typedef StoragePolicy Storage;
+};
+
+#ifdef WM_POLICY_HEADER
+#include WM_POLICY_HEADER
+#endif
+
+#ifndef WM_SCORING_POLICY
+#define WM_SCORING_POLICY WM_ScoringPolicyDefault
+#endif
+#ifndef WM_RETRY_POLICY
+#define WM_RETRY_POLICY WM_RetryPolicyDefault
+#endif
+#ifndef WM_STORAGE_POLICY
+#define WM_STORAGE_POLICY WM_StoragePolicyNVS
+#endif
+
+typedef WM_PolicySet<WM_SCORING_POLICY, WM_RETRY_POLICY, WM_STORAGE_POLICY> WM_Policies;
+
+#endif // _WIFI_MANAGER_POLICY_H_INCLUDE